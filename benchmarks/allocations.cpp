@@ -0,0 +1,88 @@
+/*
+* Copyright(c) 2017 Catalin Mihai Ghita
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files(the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions :
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+#include <wave.h>
+#include <idle.h>
+#include <timer.h>
+
+// Counts every allocation that reaches the global heap.
+// Build with WAVE_NO_POOL to compare against unpooled handles and callbacks.
+
+static std::atomic<unsigned long long> allocations{0};
+
+void* operator new(size_t size)
+{
+    ++allocations;
+    if (auto p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
+
+int main()
+{
+    using namespace wave;
+    const unsigned warmup = 1000;
+    const unsigned events = 100000;
+    auto fired = std::make_shared<unsigned>(0);
+    auto counted = std::make_shared<unsigned long long>(0);
+    auto start = std::make_shared<std::chrono::steady_clock::time_point>();
+    {
+        loop main_loop;
+        idle{ warmup + events }
+        >>= ${ return timer{ 0 }; }
+        >>= ${
+            if (++(*fired) == warmup) {
+                *counted = allocations;
+                *start = std::chrono::steady_clock::now();
+            }
+        };
+    }
+    auto elapsed = std::chrono::steady_clock::now() - *start;
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+#ifdef WAVE_NO_POOL
+    std::cout << "unpooled" << std::endl;
+#else
+    std::cout << "pooled" << std::endl;
+#endif
+    std::cout << "events: " << events << std::endl;
+    std::cout << "allocations per event: " << double(allocations - *counted) / events << std::endl;
+    std::cout << "ns per event: " << double(ns) / events << std::endl;
+    return 0;
+}
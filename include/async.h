@@ -46,15 +46,61 @@ public:
 
     template <typename F>
     void operator>>=(F&& f) {
-        handle->async_cb.reset(
-                    new detail::async_start<std::decay_t<F>, T...>{
-                        std::forward<F>(f),
-                        handle.get()
-                    });
+        handle->async_cb.template emplace<detail::async_start<std::decay_t<F>, T...>>(
+                    std::forward<F>(f),
+                    handle.get());
     }
 
 private:
     std::shared_ptr<detail::async_handle<T...>> handle;
 };
 
+// Bounded variant of async_function, producers slow down instead of
+// queueing without limit. The capacity is rounded up to a power of two.
+template <typename... T>
+class async_channel : public detail::generic_source<T...>
+{
+public:
+    explicit async_channel(size_t capacity)
+        : handle(std::make_shared<detail::channel_handle<T...>>(capacity))
+    {
+        handle->self = handle;
+    }
+
+    // Fails when the channel is full or closed.
+    template <typename... U>
+    bool try_send(U&&... values) const {
+        return handle->try_send(std::forward<U>(values)...);
+    }
+
+    // Blocks while the channel is full, fails once it is closed.
+    template <typename... U>
+    bool send(U&&... values) const {
+        const std::chrono::steady_clock::time_point* forever = nullptr;
+        return handle->send_until(forever, std::forward<U>(values)...);
+    }
+
+    template <typename Rep, typename Period, typename... U>
+    bool send_for(const std::chrono::duration<Rep, Period>& timeout, U&&... values) const {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        return handle->send_until(&deadline, std::forward<U>(values)...);
+    }
+
+    size_t depth() const { return handle->depth(); }
+    size_t capacity() const { return handle->cells.size(); }
+
+    // From any thread, messages already sent are still delivered.
+    void close() const { handle->close(); }
+
+    template <typename F>
+    void operator>>=(F&& f) {
+        handle->async_cb.template emplace<detail::channel_start<std::decay_t<F>, T...>>(
+                    std::forward<F>(f),
+                    handle.get());
+    }
+
+private:
+    std::shared_ptr<detail::channel_handle<T...>> handle;
+};
+
 }
@@ -22,29 +22,147 @@
 
 #pragma once
 
-#include <queue>
-#include <mutex>
-#include <memory>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
 
 #include <uv.h>
 
+#include "loop_private.h"
+
 #include "wave.h"
 
 namespace wave {
 namespace detail {
+	// Message of an async_function, the arguments are built in place.
+	template <typename... T>
+	struct async_node
+	{
+		typedef std::tuple<T...> tuple_type;
+
+		tuple_type& args()
+		{
+			return *reinterpret_cast<tuple_type*>(&storage);
+		}
+
+		std::atomic<async_node*> next;
+		typename std::aligned_storage<sizeof(tuple_type), alignof(tuple_type)>::type storage;
+	};
+
+	// Recycles nodes without locks. The loop thread gives back a whole
+	// drained chain at once, producers take everything there is with one
+	// exchange and keep it in a thread local cache, so no pop can suffer
+	// from ABA.
+	template <typename Node>
+	struct node_cache
+	{
+		struct local_list
+		{
+			~local_list()
+			{
+				if (auto last = head) {
+					while (auto n = last->next.load(std::memory_order_relaxed)) {
+						last = n;
+					}
+					release(head, last);
+				}
+			}
+
+			Node* head = nullptr;
+		};
+
+		static std::atomic<Node*>& shared()
+		{
+			static std::atomic<Node*> nodes{nullptr};
+			return nodes;
+		}
+
+		static Node* acquire()
+		{
+			static thread_local local_list local;
+			if (!local.head) {
+				local.head = shared().exchange(nullptr, std::memory_order_acquire);
+			}
+			if (auto n = local.head) {
+				local.head = n->next.load(std::memory_order_relaxed);
+				return n;
+			}
+			return new Node();
+		}
+
+		static void release(Node* first, Node* last)
+		{
+			auto head = shared().load(std::memory_order_relaxed);
+			do {
+				last->next.store(head, std::memory_order_relaxed);
+			} while (!shared().compare_exchange_weak(head, first,
+			                                         std::memory_order_release,
+			                                         std::memory_order_relaxed));
+		}
+	};
+
+	// Chain of consumed nodes handed back to the cache after a drain.
+	template <typename Node>
+	struct node_batch
+	{
+		~node_batch()
+		{
+			if (first) {
+				node_cache<Node>::release(first, last);
+			}
+		}
+
+		void add(Node* n)
+		{
+			n->next.store(first, std::memory_order_relaxed);
+			if (!first) {
+				last = n;
+			}
+			first = n;
+		}
+
+		Node* first = nullptr;
+		Node* last = nullptr;
+	};
+
+	// Intrusive multiple producer single consumer queue, Vyukov style.
+	// Pushing is wait free, only the loop thread pops.
 	template <typename... T>
 	struct async_handle
 	{
+		typedef async_node<T...> node;
+
 		async_handle()
-			: close_later_flag(false)
+			: head(&stub)
+			, tail(&stub)
+			, close_later_flag(false)
 		{
+			stub.next.store(nullptr, std::memory_order_relaxed);
 			async.data = this;
-			uv_async_init(uv_default_loop(), &async, default_async_cb);
+			uv_async_init(current_loop(), &async, default_async_cb);
+		}
+
+		~async_handle()
+		{
+			node_batch<node> done;
+			while (auto n = pop()) {
+				n->args().~tuple();
+				done.add(n);
+			}
 		}
 
 		void close()
 		{
+			if (uv_is_closing(reinterpret_cast<uv_handle_t*>(&async))) {
+				return;
+			}
 			uv_close(reinterpret_cast<uv_handle_t*>(&async),
 			[](uv_handle_t* handle) {
 				auto p = static_cast<async_handle*>(handle->data);
@@ -59,31 +177,75 @@ namespace detail {
 			p->close();
 		}
 
+		// Closes once the messages sent so far were delivered.
 		void close_later()
 		{
-			std::unique_lock<std::mutex> lk(queuemutex);
-			if (argsqueue.size() > 0) {
-				close_later_flag = true;
-			} else {
-				close();
-			}
+			close_later_flag.store(true, std::memory_order_release);
+			uv_async_send(&async);
 		}
 
 		template <typename... Args>
 		void invoke(Args&&... args)
 		{
-			{
-				std::unique_lock<std::mutex> lk(queuemutex);
-				argsqueue.emplace(std::make_unique<std::tuple<T...>>(std::forward<Args>(args)...));
+			auto n = node_cache<node>::acquire();
+			try {
+				new (&n->storage) typename node::tuple_type(std::forward<Args>(args)...);
+			} catch (...) {
+				node_cache<node>::release(n, n);
+				throw;
 			}
+			push(n);
 			uv_async_send(&async);
 		}
 
+		void push(node* n)
+		{
+			n->next.store(nullptr, std::memory_order_relaxed);
+			auto prev = head.exchange(n, std::memory_order_acq_rel);
+			prev->next.store(n, std::memory_order_release);
+		}
+
+		// Returns null when empty or while a producer is halfway through
+		// a push, its wakeup follows.
+		node* pop()
+		{
+			auto t = tail;
+			auto next = t->next.load(std::memory_order_acquire);
+			if (t == &stub) {
+				if (!next) {
+					return nullptr;
+				}
+				tail = next;
+				t = next;
+				next = next->next.load(std::memory_order_acquire);
+			}
+			if (next) {
+				tail = next;
+				return t;
+			}
+			if (t != head.load(std::memory_order_acquire)) {
+				return nullptr;
+			}
+			push(&stub);
+			next = t->next.load(std::memory_order_acquire);
+			if (next) {
+				tail = next;
+				return t;
+			}
+			return nullptr;
+		}
+
+		bool empty() const
+		{
+			return tail == &stub && head.load(std::memory_order_acquire) == &stub;
+		}
+
 		uv_async_t async;
-		bool close_later_flag;
-		std::mutex queuemutex;
-		std::queue<std::unique_ptr<std::tuple<T...>>> argsqueue;
-		std::unique_ptr<callback> async_cb;
+		std::atomic<node*> head;
+		node* tail;
+		node stub;
+		std::atomic<bool> close_later_flag;
+		callback async_cb;
 		std::shared_ptr<async_handle> self;
 	};
 
@@ -91,12 +253,11 @@ namespace detail {
 	struct async_handle<>
 	{
 		async_handle()
-			: count(0)
-			, close_cb(nullptr)
-			, close_later_flag(false)
+			: close_later_flag(false)
+			, count(0)
 		{
 			async.data = this;
-			uv_async_init(uv_default_loop(), &async, default_async_cb);
+			uv_async_init(current_loop(), &async, default_async_cb);
 		}
 
 		static void default_async_cb(uv_async_t* handle)
@@ -107,6 +268,9 @@ namespace detail {
 
 		void close()
 		{
+			if (uv_is_closing(reinterpret_cast<uv_handle_t*>(&async))) {
+				return;
+			}
 			uv_close(reinterpret_cast<uv_handle_t*>(&async),
 			[](uv_handle_t* handle) {
 				auto p = static_cast<async_handle*>(handle->data);
@@ -117,61 +281,63 @@ namespace detail {
 
 		void close_later()
 		{
-			if (count) {
-				close_later_flag = true;
-			} else {
-				close();
-			}
+			close_later_flag.store(true, std::memory_order_release);
+			uv_async_send(&async);
 		}
 
 		void invoke()
 		{
-			++count;
+			count.fetch_add(1, std::memory_order_release);
 			uv_async_send(&async);
 		}
 
 		uv_async_t async;
-		uv_close_cb close_cb;
-		bool close_later_flag;
-		std::atomic<int> count;
-		std::unique_ptr<callback> async_cb;
+		std::atomic<bool> close_later_flag;
+		std::atomic<unsigned> count;
+		callback async_cb;
 		std::shared_ptr<async_handle> self;
 	};
 
 	template <typename F, typename... T>
-	struct async_start : public callback
+	struct async_start
 	{
+		typedef async_node<T...> node;
+
 		async_start(F f, async_handle<T...>* h)
 			: functor(std::move(f))
 		{
 			h->async.async_cb = cb;
 		}
 
+		// Delivers every message queued before the wakeup, the ones
+		// pushed meanwhile come with their own wakeup.
 		static void cb(uv_async_t* handle)
 		{
 			auto h = static_cast<async_handle<T...>*>(handle->data);
-			auto p = static_cast<async_start*>(h->async_cb.get());
-			p->call_tuple(h, std::index_sequence_for<T...>{});
-		};
+			auto last = h->head.load(std::memory_order_acquire);
+			{
+				node_batch<node> done;
+				while (auto n = h->pop()) {
+					if (auto p = static_cast<async_start*>(h->async_cb.get())) {
+						p->call_tuple(h, n->args(), std::index_sequence_for<T...>{});
+					}
+					n->args().~tuple();
+					done.add(n);
+					if (n == last) {
+						break;
+					}
+				}
+			}
+			if (h->close_later_flag.load(std::memory_order_acquire) && h->empty()) {
+				h->close();
+			}
+		}
 
 		template <size_t... I>
-		void call_tuple(async_handle<T...>* handle, std::index_sequence<I...>)
+		void call_tuple(async_handle<T...>* handle, std::tuple<T...>& args, std::index_sequence<I...>)
 		{
-			bool notify_again = false;
-			std::unique_ptr<std::tuple<T...>> args;
-			{
-				std::unique_lock<std::mutex> lk(handle->queuemutex);
-				args = std::move(handle->argsqueue.front());
-				handle->argsqueue.pop();
-				notify_again = handle->argsqueue.size() > 0;
-			}
-			if (notify_again) {
-				uv_async_send(&handle->async);
-			} else if (handle->close_later_flag) {
-				handle->close();
-			}
 			try {
-				functor(std::move(std::get<I>(*args))...);
+				functor(std::move(std::get<I>(args))...);
 			} catch (...) {
 				handle->close();
 				handle->async_cb.reset();
@@ -182,7 +348,7 @@ namespace detail {
 	};
 
 	template <typename F>
-	struct async_start<F> : public callback
+	struct async_start<F>
 	{
 		async_start(F f, async_handle<>* h)
 			: functor(std::move(f))
@@ -193,24 +359,300 @@ namespace detail {
 		static void cb(uv_async_t* handle)
 		{
 			auto h = static_cast<async_handle<>*>(handle->data);
-			auto p = static_cast<async_start*>(h->async_cb.get());
-			p->call(h);
+			auto n = h->count.exchange(0, std::memory_order_acquire);
+			for (; n > 0; --n) {
+				auto p = static_cast<async_start*>(h->async_cb.get());
+				if (!p) {
+					break;
+				}
+				p->call(h);
+			}
+			if (h->close_later_flag.load(std::memory_order_acquire) && h->count.load() == 0) {
+				h->close();
+			}
 		}
 
 		void call(async_handle<>* handle)
 		{
-			if (--handle->count > 0) {
-				uv_async_send(&handle->async);
-			} else if (handle->close_later_flag) {
+			try {
+				functor();
+			} catch (...) {
 				handle->close();
+				handle->async_cb.reset();
+			}
+		}
+
+		F functor;
+	};
+
+	// Fixed capacity ring of a bounded channel, Vyukov style. Every cell
+	// carries a sequence number telling whose turn it is, producers claim
+	// cells with a CAS and only the loop thread consumes.
+	template <typename... T>
+	struct channel_handle
+	{
+		typedef std::tuple<T...> tuple_type;
+
+		struct cell
+		{
+			tuple_type& args()
+			{
+				return *reinterpret_cast<tuple_type*>(&storage);
+			}
+
+			std::atomic<size_t> sequence;
+			bool full;
+			typename std::aligned_storage<sizeof(tuple_type), alignof(tuple_type)>::type storage;
+		};
+
+		channel_handle(size_t capacity)
+			: cells(round_capacity(capacity))
+			, mask(cells.size() - 1)
+			, enqueue_pos(0)
+			, dequeue_pos(0)
+			, waiters(0)
+			, senders(0)
+			, closed(false)
+		{
+			for (size_t i = 0; i < cells.size(); ++i) {
+				cells[i].sequence.store(i, std::memory_order_relaxed);
+			}
+			async.data = this;
+			uv_async_init(current_loop(), &async, default_async_cb);
+		}
+
+		~channel_handle()
+		{
+			while (auto c = front()) {
+				pop(c);
+			}
+		}
+
+		static size_t round_capacity(size_t capacity)
+		{
+			size_t n = 1;
+			while (n < capacity) {
+				n <<= 1;
+			}
+			return n;
+		}
+
+		static void default_async_cb(uv_async_t* handle)
+		{
+			auto p = static_cast<channel_handle*>(handle->data);
+			p->close();
+			p->finish_close();
+		}
+
+		// Callable from any thread, the loop delivers what was sent before
+		// and closes the handle on its next wakeup.
+		void close()
+		{
+			sending guard(*this);
+			if (!closed.exchange(true)) {
+				wake_producers();
+				uv_async_send(&async);
 			}
+		}
+
+		// Waits out the producers that passed the closed check, their
+		// messages are published once it returns.
+		void wait_senders()
+		{
+			while (senders.load()) {
+				std::this_thread::yield();
+			}
+		}
+
+		// On the loop thread, once no producer can touch the handle.
+		void finish_close()
+		{
+			if (uv_is_closing(reinterpret_cast<uv_handle_t*>(&async))) {
+				return;
+			}
+			wait_senders();
+			uv_close(reinterpret_cast<uv_handle_t*>(&async),
+			[](uv_handle_t* handle) {
+				auto p = static_cast<channel_handle*>(handle->data);
+				p->async_cb.reset();
+				p->self.reset();
+			});
+		}
+
+		// Counts the threads between checking closed and their last
+		// uv_async_send, the handle is not closed while any is left.
+		struct sending
+		{
+			sending(channel_handle& h)
+				: h(h)
+			{
+				h.senders.fetch_add(1);
+			}
+
+			~sending()
+			{
+				h.senders.fetch_sub(1);
+			}
+
+			channel_handle& h;
+		};
+
+		// Fails when full or closed.
+		template <typename... Args>
+		bool try_send(Args&&... args)
+		{
+			sending guard(*this);
+			if (closed.load()) {
+				return false;
+			}
+			auto pos = enqueue_pos.load(std::memory_order_relaxed);
+			cell* c;
+			for (;;) {
+				c = &cells[pos & mask];
+				auto seq = c->sequence.load(std::memory_order_acquire);
+				auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+				if (diff == 0) {
+					if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						break;
+					}
+				} else if (diff < 0) {
+					return false;
+				} else {
+					pos = enqueue_pos.load(std::memory_order_relaxed);
+				}
+			}
+			// A claimed cell is always published, empty if building failed.
+			c->full = false;
 			try {
-				functor();
+				new (&c->storage) tuple_type(std::forward<Args>(args)...);
+				c->full = true;
+			} catch (...) {
+				c->sequence.store(pos + 1, std::memory_order_release);
+				uv_async_send(&async);
+				throw;
+			}
+			c->sequence.store(pos + 1, std::memory_order_release);
+			uv_async_send(&async);
+			return true;
+		}
+
+		template <typename Clock, typename Duration, typename... Args>
+		bool send_until(const std::chrono::time_point<Clock, Duration>* deadline, Args&&... args)
+		{
+			while (!try_send(std::forward<Args>(args)...)) {
+				std::unique_lock<std::mutex> lk(mutex);
+				++waiters;
+				auto ready = [this]() { return depth() < cells.size() || closed.load(); };
+				bool woken = true;
+				if (deadline) {
+					woken = space.wait_until(lk, *deadline, ready);
+				} else {
+					space.wait(lk, ready);
+				}
+				--waiters;
+				if (!woken || closed.load()) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		void wake_producers()
+		{
+			if (waiters.load()) {
+				std::lock_guard<std::mutex> lk(mutex);
+				space.notify_all();
+			}
+		}
+
+		size_t depth() const
+		{
+			return enqueue_pos.load() - dequeue_pos.load();
+		}
+
+		cell* front()
+		{
+			auto pos = dequeue_pos.load(std::memory_order_relaxed);
+			auto c = &cells[pos & mask];
+			if (c->sequence.load(std::memory_order_acquire) != pos + 1) {
+				return nullptr;
+			}
+			return c;
+		}
+
+		void pop(cell* c)
+		{
+			auto pos = dequeue_pos.load(std::memory_order_relaxed);
+			if (c->full) {
+				c->args().~tuple_type();
+			}
+			c->sequence.store(pos + mask + 1, std::memory_order_release);
+			dequeue_pos.store(pos + 1);
+		}
+
+		uv_async_t async;
+		std::vector<cell> cells;
+		size_t mask;
+		std::atomic<size_t> enqueue_pos;
+		std::atomic<size_t> dequeue_pos;
+		std::mutex mutex;
+		std::condition_variable space;
+		std::atomic<unsigned> waiters;
+		std::atomic<unsigned> senders;
+		std::atomic<bool> closed;
+		callback async_cb;
+		std::shared_ptr<channel_handle> self;
+	};
+
+	template <typename F, typename... T>
+	struct channel_start
+	{
+		channel_start(F f, channel_handle<T...>* h)
+			: functor(std::move(f))
+		{
+			h->async.async_cb = cb;
+		}
+
+		// Delivers at most one ring worth of messages per wakeup so a busy
+		// channel does not starve the loop. Once closed, everything sent
+		// is delivered before the handle is closed.
+		static void cb(uv_async_t* handle)
+		{
+			auto h = static_cast<channel_handle<T...>*>(handle->data);
+			bool closing = h->closed.load();
+			if (closing) {
+				h->wait_senders();
+			}
+			size_t delivered = 0;
+			while (auto c = h->front()) {
+				if (!closing && delivered++ == h->cells.size()) {
+					uv_async_send(&h->async);
+					return;
+				}
+				auto p = static_cast<channel_start*>(h->async_cb.get());
+				if (p && c->full) {
+					p->call_tuple(h, c->args(), std::index_sequence_for<T...>{});
+				}
+				h->pop(c);
+			}
+			if (closing) {
+				h->finish_close();
+				return;
+			}
+			h->wake_producers();
+		}
+
+		template <size_t... I>
+		void call_tuple(channel_handle<T...>* handle, std::tuple<T...>& args, std::index_sequence<I...>)
+		{
+			try {
+				functor(std::move(std::get<I>(args))...);
 			} catch (...) {
 				handle->close();
 				handle->async_cb.reset();
 			}
 		}
+
 		F functor;
 	};
 }
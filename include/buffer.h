@@ -0,0 +1,112 @@
+/*
+* Copyright(c) 2017 Catalin Mihai Ghita
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files(the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions :
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <cstring>
+#include <string>
+
+#include <uv.h>
+
+#include "buffer_private.h"
+
+namespace wave {
+
+// A slice of a reference counted slab. Copies share the bytes,
+// so read data can be forwarded to writers without copying.
+class buffer
+{
+public:
+    buffer()
+        : block(nullptr)
+        , offset(0)
+        , length(0)
+    {}
+
+    buffer(detail::slab* block, size_t offset, size_t length)
+        : block(block)
+        , offset(offset)
+        , length(length)
+    {
+        if (block) {
+            block->ref();
+        }
+    }
+
+    explicit buffer(const std::string& s)
+        : block(detail::slab::create(s.size()))
+        , offset(0)
+        , length(s.size())
+    {
+        std::memcpy(block->data(), s.data(), s.size());
+    }
+
+    buffer(const buffer& other)
+        : buffer(other.block, other.offset, other.length)
+    {}
+
+    buffer(buffer&& other)
+        : block(other.block)
+        , offset(other.offset)
+        , length(other.length)
+    {
+        other.block = nullptr;
+        other.length = 0;
+    }
+
+    buffer& operator=(buffer other)
+    {
+        std::swap(block, other.block);
+        std::swap(offset, other.offset);
+        std::swap(length, other.length);
+        return *this;
+    }
+
+    ~buffer()
+    {
+        if (block) {
+            block->unref();
+        }
+    }
+
+    const char* data() const { return block ? block->data() + offset : nullptr; }
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+
+    buffer slice(size_t pos, size_t len = std::string::npos) const
+    {
+        pos = pos < length ? pos : length;
+        len = len < length - pos ? len : length - pos;
+        return buffer(block, offset + pos, len);
+    }
+
+    std::string str() const { return block ? std::string(data(), size()) : std::string(); }
+    operator std::string() const { return str(); }
+
+private:
+    detail::slab* block;
+    size_t offset;
+    size_t length;
+};
+
+}
@@ -0,0 +1,278 @@
+/*
+* Copyright(c) 2017 Catalin Mihai Ghita
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files(the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions :
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <string>
+
+#include <uv.h>
+
+namespace wave {
+
+class buffer;
+
+namespace detail {
+
+// Reference counted block of bytes, the header is followed by the data.
+struct slab
+{
+    std::atomic<unsigned> refs;
+    size_t capacity;
+    bool pooled;
+    slab* next;
+
+    static slab* create(size_t capacity)
+    {
+        auto s = new (::operator new(sizeof(slab) + capacity)) slab();
+        s->refs = 1;
+        s->capacity = capacity;
+        s->pooled = false;
+        return s;
+    }
+
+    static slab* from(char* data)
+    {
+        return reinterpret_cast<slab*>(data) - 1;
+    }
+
+    void destroy()
+    {
+        this->~slab();
+        ::operator delete(this);
+    }
+
+    char* data()
+    {
+        return reinterpret_cast<char*>(this + 1);
+    }
+
+    bool unique() const
+    {
+        return refs.load(std::memory_order_acquire) == 1;
+    }
+
+    void ref()
+    {
+        refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void unref();
+};
+
+// Size class cache of read slabs. Every loop thread owns one; a slab goes
+// back to the cache of the thread dropping its last reference, or to the
+// system once that cache is full.
+class slab_pool
+{
+public:
+    enum {
+        min_size = 1024,
+        classes = 4,
+        max_cached = 32
+    };
+
+    ~slab_pool()
+    {
+        for (unsigned i = 0; i < classes; ++i) {
+            while (auto s = free_lists[i]) {
+                free_lists[i] = s->next;
+                s->destroy();
+            }
+        }
+    }
+
+    static slab_pool& local()
+    {
+        static thread_local slab_pool p;
+        return p;
+    }
+
+    // Sizes grow by four between classes: 1, 4, 16 and 64 KiB.
+    static size_t class_size(unsigned c)
+    {
+        return static_cast<size_t>(min_size) << (2 * c);
+    }
+
+    static size_t round(size_t size)
+    {
+        for (unsigned c = 0; c < classes; ++c) {
+            if (size <= class_size(c)) {
+                return class_size(c);
+            }
+        }
+        return size;
+    }
+
+    slab* acquire(size_t size)
+    {
+#ifndef WAVE_NO_POOL
+        for (unsigned c = 0; c < classes; ++c) {
+            if (size <= class_size(c)) {
+                auto s = free_lists[c];
+                if (s) {
+                    free_lists[c] = s->next;
+                    --cached[c];
+                    s->refs = 1;
+                } else {
+                    s = slab::create(class_size(c));
+                    s->pooled = true;
+                }
+                return s;
+            }
+        }
+#endif
+        return slab::create(size);
+    }
+
+    void recycle(slab* s)
+    {
+        for (unsigned c = 0; c < classes; ++c) {
+            if (s->capacity == class_size(c) && cached[c] < max_cached) {
+                s->next = free_lists[c];
+                free_lists[c] = s;
+                ++cached[c];
+                return;
+            }
+        }
+        s->destroy();
+    }
+
+private:
+    slab* free_lists[classes] = {};
+    unsigned cached[classes] = {};
+};
+
+inline void slab::unref()
+{
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        if (pooled) {
+            slab_pool::local().recycle(this);
+        } else {
+            destroy();
+        }
+    }
+}
+
+// Owns one reference to a slab, used by sources reading into slabs.
+class slab_ptr
+{
+public:
+    slab_ptr()
+        : p(nullptr)
+    {}
+
+    slab_ptr(slab_ptr&& other)
+        : p(other.p)
+    {
+        other.p = nullptr;
+    }
+
+    slab_ptr(const slab_ptr&) = delete;
+    slab_ptr& operator=(const slab_ptr&) = delete;
+
+    ~slab_ptr()
+    {
+        reset();
+    }
+
+    // Returns a slab of at least capacity bytes nobody else references.
+    slab* writable(size_t capacity)
+    {
+        if (!p || !p->unique() || p->capacity < capacity) {
+            reset(slab::create(capacity));
+        }
+        return p;
+    }
+
+    void reset(slab* s = nullptr)
+    {
+        if (p) {
+            p->unref();
+        }
+        p = s;
+    }
+
+    slab* get() const
+    {
+        return p;
+    }
+
+private:
+    slab* p;
+};
+// A payload waiting to be written, either owned or shared. Templated
+// so that it can be declared before buffer is complete.
+template <typename Buffer>
+struct basic_write_chunk
+{
+    basic_write_chunk(std::string s)
+        : data(std::move(s))
+    {}
+
+    basic_write_chunk(Buffer b)
+        : view(std::move(b))
+    {}
+
+    uv_buf_t buf()
+    {
+        if (view.data()) {
+            return uv_buf_init(const_cast<char*>(view.data()), view.size());
+        }
+        return uv_buf_init(&data[0], data.size());
+    }
+
+    // Drops the first n bytes, already written by the caller.
+    void advance(size_t n)
+    {
+        if (view.data()) {
+            view = view.slice(n);
+        } else {
+            data.erase(0, n);
+        }
+    }
+
+    std::string data;
+    Buffer view;
+};
+
+typedef basic_write_chunk<buffer> write_chunk;
+
+// Views a payload without copying it.
+inline uv_buf_t to_buf(const char* s)
+{
+    return uv_buf_init(const_cast<char*>(s), std::strlen(s));
+}
+
+// Strings and buffers.
+template <typename T>
+auto to_buf(const T& s) -> decltype(s.data(), s.size(), uv_buf_t())
+{
+    return uv_buf_init(const_cast<char*>(s.data()), s.size());
+}
+
+}
+}
@@ -0,0 +1,132 @@
+/*
+* Copyright(c) 2017 Catalin Mihai Ghita
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files(the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions :
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <exception>
+#include <memory>
+#include <utility>
+
+#include "cancel_private.h"
+#include "wave.h"
+
+namespace wave {
+
+class cancellation;
+
+namespace detail {
+
+struct cancel_access
+{
+    static const std::shared_ptr<cancel_state>& state(const cancellation& token);
+};
+
+template <typename F, typename Sig = decltype(&F::operator())>
+struct cancellable_t;
+
+// Keeps the signature of the wrapped lambda so it composes like one.
+template <typename F, typename C, typename R, typename... Args>
+struct cancellable_t<F, R(C::*)(Args...) const>
+{
+    R operator()(Args... args) const;
+
+    F f;
+    std::shared_ptr<cancel_state> state;
+};
+
+template <typename F, typename C, typename R, typename... Args>
+struct cancellable_t<F, R(C::*)(Args...)>
+{
+    R operator()(Args... args);
+
+    F f;
+    std::shared_ptr<cancel_state> state;
+};
+
+}
+
+// Thrown by a cancellable stage once its token fired, ending the chain.
+class operation_cancelled : public std::exception
+{
+public:
+    const char* what() const noexcept override { return "operation cancelled"; }
+};
+
+// Token shared by the parts of a pipeline. Cancelling it closes the
+// streams and timers hooked to it, skips hooked work not started yet
+// and lets running tasks notice through cancelled().
+class cancellation
+{
+public:
+    cancellation()
+        : state(std::make_shared<detail::cancel_state>())
+    {}
+
+    // Thread safe, the hooks run on the loop that created the token.
+    void cancel() const { state->cancel(); }
+    bool cancelled() const { return state->cancelled; }
+
+    // Cancels after timeout milliseconds, from the loop thread.
+    void cancel_after(uint64_t timeout) const { state->cancel_after(timeout); }
+
+private:
+    friend struct detail::cancel_access;
+
+    std::shared_ptr<detail::cancel_state> state;
+};
+
+namespace detail {
+
+inline const std::shared_ptr<cancel_state>& cancel_access::state(const cancellation& token)
+{
+    return token.state;
+}
+
+template <typename F, typename C, typename R, typename... Args>
+R cancellable_t<F, R(C::*)(Args...) const>::operator()(Args... args) const
+{
+    if (state->cancelled) {
+        throw operation_cancelled();
+    }
+    return f(std::forward<Args>(args)...);
+}
+
+template <typename F, typename C, typename R, typename... Args>
+R cancellable_t<F, R(C::*)(Args...)>::operator()(Args... args)
+{
+    if (state->cancelled) {
+        throw operation_cancelled();
+    }
+    return f(std::forward<Args>(args)...);
+}
+
+}
+
+// Wraps a stage so events stop flowing through it once the token fired.
+template <typename F>
+decltype(auto) cancellable(const cancellation& token, F&& f)
+{
+    return detail::cancellable_t<std::decay_t<F>>{ std::forward<F>(f), detail::cancel_access::state(token) };
+}
+
+}
@@ -0,0 +1,186 @@
+/*
+* Copyright(c) 2017 Catalin Mihai Ghita
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files(the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions :
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include <uv.h>
+
+#include "loop_private.h"
+
+namespace wave {
+namespace detail {
+
+struct cancel_state;
+
+// Ties a handle to a token, unlinked when the handle goes away or the
+// token fires. Loop thread only.
+struct cancel_registration
+{
+    cancel_registration()
+        : prev(nullptr)
+        , next(nullptr)
+        , owner(nullptr)
+        , fn(nullptr)
+    {}
+
+    cancel_registration(const cancel_registration&) = delete;
+    cancel_registration& operator=(const cancel_registration&) = delete;
+
+    ~cancel_registration()
+    {
+        unlink();
+    }
+
+    void link(std::shared_ptr<cancel_state> s, void* o, void (*f)(void*));
+    void unlink();
+
+    std::shared_ptr<cancel_state> state;
+    cancel_registration* prev;
+    cancel_registration* next;
+    void* owner;
+    void (*fn)(void*);
+};
+
+// Shared by the copies of a cancellation. The flag can be read from any
+// thread, the hooks always run on the loop that created the token.
+struct cancel_state : public std::enable_shared_from_this<cancel_state>
+{
+    cancel_state()
+        : cancelled(false)
+        , owner(&current_loop_handle())
+        , owner_thread(std::this_thread::get_id())
+        , hooks(nullptr)
+        , deadline(nullptr)
+    {}
+
+    ~cancel_state()
+    {
+        stop_deadline();
+    }
+
+    void cancel()
+    {
+        if (cancelled.exchange(true)) {
+            return;
+        }
+        if (std::this_thread::get_id() == owner_thread) {
+            fire();
+        } else {
+            auto self = shared_from_this();
+            owner->post([self]() { self->fire(); });
+        }
+    }
+
+    void fire()
+    {
+        stop_deadline();
+        auto keep_alive = shared_from_this();
+        while (auto r = hooks) {
+            r->unlink();
+            r->fn(r->owner);
+        }
+    }
+
+    // Loop thread only.
+    void cancel_after(uint64_t timeout)
+    {
+        if (cancelled) {
+            return;
+        }
+        if (!deadline) {
+            deadline = new uv_timer_t;
+            uv_timer_init(owner->loop, deadline);
+            uv_unref(reinterpret_cast<uv_handle_t*>(deadline));
+        }
+        deadline->data = this;
+        uv_timer_start(deadline, [](uv_timer_t* t) {
+            static_cast<cancel_state*>(t->data)->cancel();
+        }, timeout, 0);
+    }
+
+    void stop_deadline()
+    {
+        if (auto t = deadline) {
+            deadline = nullptr;
+            auto close = [t]() {
+                uv_close(reinterpret_cast<uv_handle_t*>(t), [](uv_handle_t* h) {
+                    delete reinterpret_cast<uv_timer_t*>(h);
+                });
+            };
+            if (std::this_thread::get_id() == owner_thread) {
+                close();
+            } else {
+                owner->post(close);
+            }
+        }
+    }
+
+    std::atomic<bool> cancelled;
+    loop_handle* owner;
+    std::thread::id owner_thread;
+    cancel_registration* hooks;
+    uv_timer_t* deadline;
+};
+
+// Runs fn(o) when the token fires, right away if it already did.
+inline void cancel_registration::link(std::shared_ptr<cancel_state> s, void* o, void (*f)(void*))
+{
+    unlink();
+    if (s->cancelled) {
+        f(o);
+        return;
+    }
+    state = std::move(s);
+    owner = o;
+    fn = f;
+    prev = nullptr;
+    next = state->hooks;
+    if (next) {
+        next->prev = this;
+    }
+    state->hooks = this;
+}
+
+inline void cancel_registration::unlink()
+{
+    if (!state) {
+        return;
+    }
+    if (prev) {
+        prev->next = next;
+    } else {
+        state->hooks = next;
+    }
+    if (next) {
+        next->prev = prev;
+    }
+    prev = next = nullptr;
+    state.reset();
+}
+
+}
+}
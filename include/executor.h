@@ -0,0 +1,72 @@
+/*
+* Copyright(c) 2017 Catalin Mihai Ghita
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files(the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions :
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <memory>
+
+#include "executor_flags.h"
+#include "executor_private.h"
+
+namespace wave {
+
+namespace detail {
+struct executor_access;
+}
+
+using lane_stats = detail::lane_stats;
+
+// Dedicated pool for queue_work, so CPU bound tasks do not wait behind
+// file requests in the libuv pool and the other way around.
+class executor
+{
+public:
+    explicit executor(unsigned size = std::thread::hardware_concurrency(), executor_flags flags = unpinned)
+        : handle(std::make_shared<detail::executor_handle>(size, flags == pin_threads))
+    {}
+
+    size_t size() const { return handle->size(); }
+
+    // Number of tasks run from a lane and how long they waited.
+    lane_stats stats(work_priority lane) const { return handle->stats(lane); }
+
+private:
+    friend struct detail::executor_access;
+
+    std::shared_ptr<detail::executor_handle> handle;
+};
+
+namespace detail {
+
+// Lets the sources running on an executor reach its threads.
+struct executor_access
+{
+    static const std::shared_ptr<executor_handle>& handle(const executor& pool)
+    {
+        return pool.handle;
+    }
+};
+
+}
+
+}
@@ -0,0 +1,320 @@
+/*
+* Copyright(c) 2017 Catalin Mihai Ghita
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files(the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions :
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "executor_flags.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace wave {
+namespace detail {
+
+// Wait time of the tasks run from one lane.
+struct lane_stats
+{
+    uint64_t tasks;
+    uint64_t total_wait_ns;
+    uint64_t max_wait_ns;
+};
+
+// Thread pool owned by wave, apart from the libuv one serving file requests.
+// Every thread has a deque per priority lane and serves its own lanes
+// first, the newest of the tasks it submitted itself while their data is
+// still in cache, else the oldest. It steals the oldest tasks of the
+// others when it runs dry. Every few pops a thread looks for
+// tasks waiting longer than the aging limit of their lane, those go
+// before the higher lanes.
+struct executor_handle
+{
+    enum {
+        lanes = 3,
+        aging_scan_every = 16
+    };
+
+    typedef std::chrono::steady_clock clock;
+
+    struct queued_task
+    {
+        std::function<void()> run;
+        clock::time_point enqueued;
+        bool local;
+    };
+
+    struct worker_queue
+    {
+        std::mutex mutex;
+        std::deque<queued_task> tasks[lanes];
+    };
+
+    struct lane_counters
+    {
+        std::atomic<uint64_t> tasks{0};
+        std::atomic<uint64_t> total_wait_ns{0};
+        std::atomic<uint64_t> max_wait_ns{0};
+    };
+
+    static clock::duration aging_limit(unsigned lane)
+    {
+        static const clock::duration limits[lanes] = {
+            clock::duration::max(),
+            std::chrono::milliseconds(20),
+            std::chrono::milliseconds(200)
+        };
+        return limits[lane];
+    }
+
+    executor_handle(unsigned size, bool pin)
+        : queues(size ? size : 1)
+        , next(0)
+        , pending(0)
+        , stopping(false)
+    {
+        for (unsigned i = 0; i < queues.size(); ++i) {
+            threads.emplace_back([this, i]() {
+                current() = this;
+                index() = i;
+                run(i);
+            });
+            if (pin) {
+                pin_thread(threads.back(), i);
+            }
+        }
+    }
+
+    // Runs the tasks left before joining, loops may wait for them.
+    ~executor_handle()
+    {
+        {
+            std::lock_guard<std::mutex> lk(sleep_mutex);
+            stopping = true;
+        }
+        sleep_cv.notify_all();
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    static executor_handle*& current()
+    {
+        static thread_local executor_handle* e = nullptr;
+        return e;
+    }
+
+    static unsigned& index()
+    {
+        static thread_local unsigned i = 0;
+        return i;
+    }
+
+    static void pin_thread(std::thread& t, unsigned i)
+    {
+#ifdef __linux__
+        auto cpus = std::thread::hardware_concurrency();
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(i % (cpus ? cpus : 1), &set);
+        pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+#else
+        (void)t;
+        (void)i;
+#endif
+    }
+
+    // Tasks submitted by the pool threads stay on their own deque,
+    // the others are spread round robin.
+    void submit(std::function<void()> task, work_priority lane = normal)
+    {
+        bool local = current() == this;
+        auto i = local ? index() : next++ % queues.size();
+        {
+            std::lock_guard<std::mutex> lk(queues[i].mutex);
+            queues[i].tasks[lane].push_back({ std::move(task), clock::now(), local });
+        }
+        pending.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> lk(sleep_mutex);
+        }
+        sleep_cv.notify_one();
+    }
+
+    // Spreads a batch over all deques and wakes every thread once.
+    void submit(std::vector<std::function<void()>> tasks, work_priority lane = normal)
+    {
+        auto first = next.fetch_add(static_cast<unsigned>(tasks.size()));
+        auto now = clock::now();
+        for (size_t k = 0; k < tasks.size(); ++k) {
+            auto& q = queues[(first + k) % queues.size()];
+            std::lock_guard<std::mutex> lk(q.mutex);
+            q.tasks[lane].push_back({ std::move(tasks[k]), now, false });
+        }
+        pending.fetch_add(static_cast<unsigned>(tasks.size()));
+        {
+            std::lock_guard<std::mutex> lk(sleep_mutex);
+        }
+        sleep_cv.notify_all();
+    }
+
+    static bool take(worker_queue& q, unsigned lane, queued_task& task)
+    {
+        std::lock_guard<std::mutex> lk(q.mutex);
+        if (q.tasks[lane].empty()) {
+            return false;
+        }
+        task = std::move(q.tasks[lane].front());
+        q.tasks[lane].pop_front();
+        return true;
+    }
+
+    static bool take_starving(worker_queue& q, unsigned lane, clock::time_point now, queued_task& task)
+    {
+        std::lock_guard<std::mutex> lk(q.mutex);
+        if (q.tasks[lane].empty() || now - q.tasks[lane].front().enqueued <= aging_limit(lane)) {
+            return false;
+        }
+        task = std::move(q.tasks[lane].front());
+        q.tasks[lane].pop_front();
+        return true;
+    }
+
+    static bool take_own(worker_queue& q, queued_task& task, unsigned& lane)
+    {
+        std::lock_guard<std::mutex> lk(q.mutex);
+        for (lane = 0; lane < lanes; ++lane) {
+            auto& d = q.tasks[lane];
+            if (d.empty()) {
+                continue;
+            }
+            if (d.back().local) {
+                task = std::move(d.back());
+                d.pop_back();
+            } else {
+                task = std::move(d.front());
+                d.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    bool take_any_starving(unsigned self, queued_task& task, unsigned& lane)
+    {
+        auto now = clock::now();
+        for (lane = lanes - 1; lane > 0; --lane) {
+            for (unsigned k = 0; k < queues.size(); ++k) {
+                if (take_starving(queues[(self + k) % queues.size()], lane, now, task)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // The own deque takes one lock, the other deques are only looked at
+    // when it is empty or on an aging scan.
+    bool pop(unsigned self, unsigned& pops, queued_task& task, unsigned& lane)
+    {
+        if (++pops % aging_scan_every == 0 && take_any_starving(self, task, lane)) {
+            return true;
+        }
+        if (take_own(queues[self], task, lane)) {
+            return true;
+        }
+        for (lane = 0; lane < lanes; ++lane) {
+            for (unsigned k = 1; k < queues.size(); ++k) {
+                if (take(queues[(self + k) % queues.size()], lane, task)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void record(unsigned lane, clock::time_point enqueued)
+    {
+        auto wait = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - enqueued).count());
+        auto& c = counters[lane];
+        c.tasks.fetch_add(1, std::memory_order_relaxed);
+        c.total_wait_ns.fetch_add(wait, std::memory_order_relaxed);
+        auto max = c.max_wait_ns.load(std::memory_order_relaxed);
+        while (wait > max && !c.max_wait_ns.compare_exchange_weak(max, wait, std::memory_order_relaxed)) {}
+    }
+
+    lane_stats stats(unsigned lane) const
+    {
+        auto& c = counters[lane];
+        return { c.tasks.load(), c.total_wait_ns.load(), c.max_wait_ns.load() };
+    }
+
+    void run(unsigned self)
+    {
+        unsigned pops = 0;
+        for (;;) {
+            queued_task task;
+            unsigned lane;
+            if (pop(self, pops, task, lane)) {
+                pending.fetch_sub(1);
+                record(lane, task.enqueued);
+                task.run();
+                continue;
+            }
+            std::unique_lock<std::mutex> lk(sleep_mutex);
+            sleep_cv.wait(lk, [this]() { return pending.load() > 0 || stopping; });
+            if (stopping && pending.load() == 0) {
+                return;
+            }
+        }
+    }
+
+    size_t size() const
+    {
+        return queues.size();
+    }
+
+    std::vector<worker_queue> queues;
+    lane_counters counters[lanes];
+    std::vector<std::thread> threads;
+    std::atomic<unsigned> next;
+    std::atomic<unsigned> pending;
+    std::mutex sleep_mutex;
+    std::condition_variable sleep_cv;
+    bool stopping;
+};
+
+}
+}
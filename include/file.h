@@ -24,11 +24,12 @@
 
 #include "wave.h"
 
+#include "buffer.h"
 #include "file_private.h"
 
 namespace wave {
 
-using file_read_source = source<std::shared_ptr<detail::file_handle>, detail::read_file, std::string>;
+using file_read_source = source<std::shared_ptr<detail::file_handle>, detail::read_file, buffer>;
 using file_wrote_source = source<std::shared_ptr<detail::file_handle>, detail::write_file>;
 
 class file : public file_read_source
@@ -28,15 +28,35 @@
 
 #include <uv.h>
 
+#include "buffer.h"
+#include "loop_private.h"
+#include "pool_private.h"
+#include "wave_private.h"
+
 namespace wave {
 namespace detail {
-struct file_handle
+
+struct file_handle;
+
+// Buffers written by one uv_fs_write, kept alive until its callback.
+struct file_write_request : public pooled
+{
+    uv_fs_t req;
+    std::vector<write_chunk> data;
+    std::vector<uv_buf_t> bufs;
+    std::shared_ptr<file_handle> owner;
+};
+
+struct file_handle : public std::enable_shared_from_this<file_handle>
 {
     file_handle(std::string file_name)
+        : loop(current_loop())
+        , writing(nullptr)
+        , queued(nullptr)
+        , wrote_cb(default_wrote_cb)
     {
-        write_req.cb = default_wrote_cb;
         close_req.data = nullptr;
-        if (uv_fs_open(uv_default_loop(), &open_req, file_name.c_str(), O_RDWR, 0, nullptr) <= 0) {
+        if (uv_fs_open(loop, &open_req, file_name.c_str(), O_RDWR, 0, nullptr) <= 0) {
             throw std::runtime_error("Cound not open file " + file_name);
         }
 
@@ -46,64 +66,114 @@ struct file_handle
     {
         if (close_req.data != this) {
             close_req.data = this;
-            uv_fs_close(uv_default_loop(), &close_req, open_req.result,
+            uv_fs_close(loop, &close_req, open_req.result,
                         [](uv_fs_t* handle) {
                 auto p = static_cast<file_handle*>(handle->data);
-                std::unique_ptr<callback> read_cb(std::move(p->read_cb));
-                std::unique_ptr<callback> write_cb(std::move(p->write_cb));
+                auto keep_alive = p->shared_from_this();
+                p->read_cb.reset();
+                p->write_cb.reset();
             });
             uv_fs_req_cleanup(&open_req);
         }
     }
 
-    void write(std::string s)
+    ~file_handle()
+    {
+        delete queued;
+    }
+
+    // Writes are appended in order, the ones issued while another
+    // is in flight are coalesced into a single vectored write.
+    template <typename String>
+    void write(String&& s)
+    {
+        if (!queued) {
+            queued = new file_write_request();
+        }
+        queued->data.emplace_back(std::forward<String>(s));
+        if (!writing) {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        auto r = queued;
+        queued = nullptr;
+        for (auto& d : r->data) {
+            r->bufs.push_back(d.buf());
+        }
+        r->req.data = r;
+        r->owner = shared_from_this();
+        writing = r;
+        if (uv_fs_write(loop, &r->req, open_req.result, r->bufs.data(), r->bufs.size(), -1, write_done) < 0) {
+            write_done(&r->req);
+        }
+    }
+
+    static void write_done(uv_fs_t* req)
     {
-        buff = uv_buf_init(const_cast<char*>(s.data()), s.size());
-        uv_fs_write(uv_default_loop(), &write_req, open_req.result, &buff, 1, -1, write_req.cb);
+        auto r = static_cast<file_write_request*>(req->data);
+        auto p = std::move(r->owner);
+        auto result = req->result;
+        auto count = static_cast<unsigned>(r->data.size());
+        uv_fs_req_cleanup(req);
+        delete r;
+        p->writing = nullptr;
+        if (result >= 0 && p->queued) {
+            p->flush();
+        }
+        p->wrote_cb(p.get(), result, count);
     }
 
-    static void default_wrote_cb(uv_fs_t*)
+    static void default_wrote_cb(file_handle*, ssize_t, unsigned)
     {
     }
 
+    uv_loop_t* loop;
     uv_fs_t open_req;
     uv_fs_t close_req;
-    uv_fs_t write_req;
-    uv_buf_t buff;
-    std::unique_ptr<callback> read_cb;
-    std::unique_ptr<callback> write_cb;
+    file_write_request* writing;
+    file_write_request* queued;
+    void (*wrote_cb)(file_handle*, ssize_t, unsigned);
+    callback read_cb;
+    callback write_cb;
 };
 
 template <typename F, typename S>
-struct read_file : public callback
+struct read_file
 {
+    static callback& slot(file_handle& h) { return h.read_cb; }
+
     read_file(F f, std::shared_ptr<file_handle> file)
-        : functor(std::move(f))
-        , handle(std::move(file))
-        , memory(8 * 1024)
+        : handle(std::move(file))
+        , functor(std::move(f))
     {
         read_req.data = this;
-        handle->read_cb.reset(this);
-        buff = uv_buf_init(memory.data(), memory.size());
         read();
     }
 
+    // Reads into the same slab while the previous chunks were not retained.
     void read()
     {
-        uv_fs_read(uv_default_loop(), &read_req, handle->open_req.result, &buff, 1, -1,
+        auto block = memory.writable(8 * 1024);
+        buff = uv_buf_init(block->data(), block->capacity);
+        uv_fs_read(handle->loop, &read_req, handle->open_req.result, &buff, 1, -1,
                    [](uv_fs_t *req) {
             auto p = static_cast<read_file*>(req->data);
             if (req->result > 0) {
-                p->functor(std::string(p->buff.base, req->result));
+                p->functor(S(p->memory.get(), 0, req->result));
                 uv_fs_req_cleanup(req);
                 p->read();
             } else {
+                fail(p->functor, req->result < 0 ? static_cast<int>(req->result) : UV_EOF);
+                uv_fs_req_cleanup(req);
                 p->handle->read_cb.reset();
             }
         });
     }
 
-    std::vector<char> memory;
+    slab_ptr memory;
     uv_fs_t read_req;
     uv_buf_t buff;
     std::shared_ptr<file_handle> handle;
@@ -111,27 +181,42 @@ struct read_file : public callback
 };
 
 template <typename F>
-struct write_file : public callback
+struct write_file
 {
+    static callback& slot(file_handle& h) { return h.write_cb; }
+
     write_file(F f, const std::shared_ptr<file_handle>& file)
         : functor(std::move(f))
-        , handle(file)
     {
-        handle->write_cb.reset(this);
-        handle->write_req.data = this;
-        handle->write_req.cb = wrote_cb;
+        file->wrote_cb = cb;
     }
 
-    static void wrote_cb(uv_fs_t *req) {
-        auto p = static_cast<write_file*>(req->data);
-        if (req->result > 0) {
-            p->functor();
+    // Fires once for every buffer of the completed write.
+    static void cb(file_handle* h, ssize_t result, unsigned count)
+    {
+        try {
+            if (result < 0) {
+                if (auto p = static_cast<write_file*>(h->write_cb.get())) {
+                    fail(p->functor, static_cast<int>(result));
+                }
+                h->wrote_cb = file_handle::default_wrote_cb;
+                h->write_cb.reset();
+                return;
+            }
+            for (unsigned i = 0; i < count; ++i) {
+                auto p = static_cast<write_file*>(h->write_cb.get());
+                if (!p) {
+                    break;
+                }
+                p->functor();
+            }
+        }
+        catch (...) {
+            h->wrote_cb = file_handle::default_wrote_cb;
+            h->write_cb.reset();
         }
-        uv_fs_req_cleanup(req);
-        p->handle->write_cb.reset();
     }
 
-    std::shared_ptr<file_handle> handle;
     F functor;
 };
 
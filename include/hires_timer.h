@@ -0,0 +1,68 @@
+/*
+* Copyright(c) 2017 Catalin Mihai Ghita
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files(the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions :
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#include "cancel.h"
+#include "hires_timer_private.h"
+
+#include "wave.h"
+
+namespace wave {
+
+using hires_tick_source = source<detail::hires_timer_handle*, detail::hires_ticking, uint64_t>;
+
+// Timer with sub millisecond resolution on Linux timerfd. Every tick
+// emits how many periods elapsed since the previous one, more than one
+// when the loop fell behind.
+class hires_timer : public hires_tick_source
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    // Fires after timeout, then every timeout, times ticks in total,
+    // zero meaning forever.
+    hires_timer(std::chrono::nanoseconds timeout, unsigned times = 1)
+        : base{ new detail::hires_timer_handle(timeout, timeout, times, false) }
+    {}
+
+    // Fires at the deadline of the steady clock, then every interval.
+    hires_timer(clock::time_point deadline, std::chrono::nanoseconds interval = std::chrono::nanoseconds(0),
+                unsigned times = 1)
+        : base{ new detail::hires_timer_handle(deadline.time_since_epoch(), interval, times, true) }
+    {}
+
+    void stop() const { handle->stop(); }
+
+    // Stops the timer when the token fires.
+    const hires_timer& cancel_on(const cancellation& token) const
+    {
+        handle->cancel_on(detail::cancel_access::state(token));
+        return *this;
+    }
+};
+
+}
@@ -0,0 +1,184 @@
+/*
+* Copyright(c) 2017 Catalin Mihai Ghita
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files(the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions :
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+
+#include <uv.h>
+
+#ifdef __linux__
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+#include "cancel_private.h"
+#include "loop_private.h"
+#include "pool_private.h"
+#include "wave_private.h"
+
+namespace wave {
+namespace detail {
+
+// Timer on a timerfd polled by the loop, with nanosecond resolution.
+// Periodic ticks are kept by the kernel, so they do not drift.
+struct hires_timer_handle : public pooled
+{
+    uv_poll_t poll;
+    int fd;
+    unsigned times;
+    callback timer_cb;
+    cancel_registration cancel_hook;
+
+    hires_timer_handle(std::chrono::nanoseconds timeout, std::chrono::nanoseconds interval,
+                       unsigned times, bool absolute)
+        : fd(-1)
+        , times(times)
+    {
+#ifdef __linux__
+        fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error("Could not create timerfd");
+        }
+        itimerspec spec{ to_timespec(interval), to_timespec(timeout) };
+        if (!absolute && spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+            // A zero value would disarm the timer.
+            spec.it_value.tv_nsec = 1;
+        }
+        if (timerfd_settime(fd, absolute ? TFD_TIMER_ABSTIME : 0, &spec, nullptr) < 0) {
+            ::close(fd);
+            throw std::runtime_error("Could not arm timerfd");
+        }
+        uv_poll_init(current_loop(), &poll, fd);
+        poll.data = this;
+        uv_poll_start(&poll, UV_READABLE, default_poll_cb);
+#else
+        (void)timeout;
+        (void)interval;
+        (void)absolute;
+        throw std::runtime_error("hires_timer needs timerfd");
+#endif
+    }
+
+    static timespec to_timespec(std::chrono::nanoseconds ns)
+    {
+        timespec t;
+        t.tv_sec = static_cast<time_t>(ns.count() / 1000000000);
+        t.tv_nsec = static_cast<long>(ns.count() % 1000000000);
+        return t;
+    }
+
+    // Number of expirations since the previous call, zero if none.
+    uint64_t expirations()
+    {
+        uint64_t n = 0;
+#ifdef __linux__
+        if (::read(fd, &n, sizeof(n)) != sizeof(n)) {
+            return 0;
+        }
+#endif
+        return n;
+    }
+
+    static void default_poll_cb(uv_poll_t* handle, int, int)
+    {
+        auto h = static_cast<hires_timer_handle*>(handle->data);
+        h->expirations();
+        h->stop();
+    }
+
+    void cancel_on(std::shared_ptr<cancel_state> token)
+    {
+        cancel_hook.link(std::move(token), this, [](void* p) {
+            static_cast<hires_timer_handle*>(p)->stop();
+        });
+    }
+
+    void after(uint64_t n)
+    {
+        if (times > 0) {
+            if (n >= times) {
+                stop();
+            } else {
+                times -= static_cast<unsigned>(n);
+            }
+        }
+    }
+
+    void stop()
+    {
+        if (!uv_is_closing(reinterpret_cast<uv_handle_t*>(&poll))) {
+            uv_poll_stop(&poll);
+            uv_close(reinterpret_cast<uv_handle_t*>(&poll),
+                     [](uv_handle_t* handle) {
+                auto p = static_cast<hires_timer_handle*>(handle->data);
+#ifdef __linux__
+                ::close(p->fd);
+#endif
+                delete p;
+            });
+        }
+    }
+};
+
+template <class F, class... Args>
+struct hires_ticking
+{
+    static callback& slot(hires_timer_handle& h) { return h.timer_cb; }
+
+    hires_ticking(F f, hires_timer_handle* h)
+        : functor(std::move(f))
+    {
+        uv_poll_start(&h->poll, UV_READABLE, cb);
+    }
+
+    static void cb(uv_poll_t* handle, int status, int)
+    {
+        auto h = static_cast<hires_timer_handle*>(handle->data);
+        try {
+            auto p = static_cast<hires_ticking*>(h->timer_cb.get());
+            if (status < 0) {
+                fail(p->functor, status);
+                h->stop();
+                h->timer_cb.reset();
+                return;
+            }
+            auto n = h->expirations();
+            if (n == 0) {
+                return;
+            }
+            p->functor(n);
+            h->after(n);
+        } catch (...) {
+            h->stop();
+            h->timer_cb.reset();
+        }
+    }
+
+    F functor;
+};
+
+}
+}
@@ -22,7 +22,9 @@
 
 #pragma once
 
+#include <chrono>
 #include <memory>
+#include <type_traits>
 
 #include "idle_private.h"
 #include "wave.h"
@@ -41,4 +43,22 @@ public:
     void stop() const { handle->stop(); }
 };
 
+// Runs f on the current loop while it has spare time. A task returning
+// bool is run again for as long as it returns true.
+template <typename F>
+void when_idle(F&& f)
+{
+    using again = std::is_same<decltype(f()), bool>;
+    detail::current_loop_handle().service<detail::idle_scheduler>()
+        .push(detail::idle_task(std::forward<F>(f), again{}));
+}
+
+// Longest time the current loop spends on idle tasks per iteration,
+// one millisecond by default. At least one task runs every iteration.
+inline void set_idle_budget(std::chrono::microseconds budget)
+{
+    detail::current_loop_handle().service<detail::idle_scheduler>().budget =
+        static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(budget).count());
+}
+
 }
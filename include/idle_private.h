@@ -22,21 +22,29 @@
 
 #pragma once
 
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <type_traits>
+
 #include <uv.h>
 
+#include "loop_private.h"
+#include "pool_private.h"
+
 namespace wave {
 namespace detail {
 
-struct idle_handle
+struct idle_handle : public pooled
 {
     uv_idle_t idle;
     unsigned times;
-    std::unique_ptr<callback> idle_cb;
+    callback idle_cb;
 
     idle_handle(unsigned times)
         : times(times)
     {
-        uv_idle_init(uv_default_loop(), &idle);
+        uv_idle_init(current_loop(), &idle);
         idle.data = this;
         uv_idle_start(&idle, default_idle_cb);
     }
@@ -65,20 +73,89 @@ struct idle_handle
     }
 };
 
+// Background tasks of one loop, run from an idle handle that is only
+// active while some are queued. Every iteration runs tasks until the
+// budget is spent, then lets the loop poll again. A task returning true
+// has more to do and goes to the back of the queue.
+struct idle_scheduler : public loop_service
+{
+    idle_scheduler(loop_handle& l)
+        : budget(1000000)
+    {
+        uv_idle_init(l.loop, &idle);
+        idle.data = this;
+    }
+
+    void close() override
+    {
+        uv_close(reinterpret_cast<uv_handle_t*>(&idle), nullptr);
+    }
+
+    void push(std::function<bool()> task)
+    {
+        tasks.push_back(std::move(task));
+        if (!uv_is_active(reinterpret_cast<uv_handle_t*>(&idle))) {
+            uv_idle_start(&idle, cb);
+        }
+    }
+
+    // Tasks queued during a slice wait for the next one.
+    static void cb(uv_idle_t* handle)
+    {
+        auto s = static_cast<idle_scheduler*>(handle->data);
+        auto deadline = uv_hrtime() + s->budget;
+        auto n = s->tasks.size();
+        do {
+            auto task = std::move(s->tasks.front());
+            s->tasks.pop_front();
+            bool again = false;
+            try {
+                again = task();
+            } catch (...) {
+            }
+            if (again) {
+                s->tasks.push_back(std::move(task));
+            }
+        } while (--n && !s->tasks.empty() && uv_hrtime() < deadline);
+        if (s->tasks.empty()) {
+            uv_idle_stop(handle);
+        }
+    }
+
+    uv_idle_t idle;
+    uint64_t budget;
+    std::deque<std::function<bool()>> tasks;
+};
+
+template <typename F>
+std::function<bool()> idle_task(F&& f, std::true_type)
+{
+    return std::forward<F>(f);
+}
+
+template <typename F>
+std::function<bool()> idle_task(F&& f, std::false_type)
+{
+    return [functor = std::forward<F>(f)]() mutable {
+        functor();
+        return false;
+    };
+}
+
 template <class F>
-struct idling : public callback
+struct idling
 {
+    static callback& slot(idle_handle& h) { return h.idle_cb; }
+
     idling(F&& f, idle_handle* h)
         : functor(std::move(f))
     {
-        h->idle_cb.reset(this);
         h->idle.idle_cb = cb;
     }
 
     idling(const F& f, idle_handle* h)
         : functor(f)
     {
-        h->idle_cb.reset(this);
         h->idle.idle_cb = cb;
     }
 
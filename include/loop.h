@@ -0,0 +1,154 @@
+/*
+* Copyright(c) 2017 Catalin Mihai Ghita
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files(the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions :
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "loop_private.h"
+#include "wave_private.h"
+
+namespace wave {
+
+class tcp_acceptor;
+
+class loop
+{
+public:
+    loop()
+        : handle(new detail::loop_handle())
+        , previous(detail::loop_handle::current())
+    {
+        detail::loop_handle::current() = handle;
+    }
+
+    loop(const loop&) = delete;
+    loop& operator=(const loop&) = delete;
+
+    ~loop()
+    {
+        handle->run();
+        delete handle;
+        detail::loop_handle::current() = previous;
+    }
+
+    // From any thread, f runs on the loop after a wakeup. On the loop's
+    // own thread post_local is cheaper.
+    template <typename F>
+    void post(F&& f) const
+    {
+        handle->post(std::forward<F>(f));
+    }
+
+private:
+    detail::loop_handle* handle;
+    detail::loop_handle* previous;
+};
+
+class loop_group : public detail::generic_source<unsigned>
+{
+public:
+    loop_group(unsigned size = std::thread::hardware_concurrency())
+    {
+        for (unsigned i = 0; i < (size ? size : 1); ++i) {
+            auto h = new detail::loop_handle();
+            h->hold();
+            handles.push_back(h);
+            threads.emplace_back([h] {
+                detail::loop_handle::current() = h;
+                h->run();
+            });
+        }
+    }
+
+    loop_group(const loop_group&) = delete;
+    loop_group& operator=(const loop_group&) = delete;
+
+    ~loop_group()
+    {
+        for (auto h : handles) {
+            h->post([h] { h->release(); });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        for (auto h : handles) {
+            delete h;
+        }
+    }
+
+    // One functor is shared by all loops, its finalizer runs after the
+    // last of them. An exception ends the subscription, the loops that
+    // did not call the functor yet skip it.
+    template <typename F>
+    void operator>>=(F&& f) const
+    {
+        struct shared
+        {
+            std::decay_t<F> functor;
+            std::atomic<bool> failed;
+        };
+        auto state = std::shared_ptr<shared>(new shared{ std::forward<F>(f), { false } });
+        for (unsigned i = 0; i < handles.size(); ++i) {
+            handles[i]->post([this, state, i] {
+                if (state->failed) {
+                    return;
+                }
+                try {
+                    state->functor(i);
+                } catch (...) {
+                    state->failed = true;
+                    std::lock_guard<std::mutex> lock(failure_mutex);
+                    if (!failure) {
+                        failure = std::current_exception();
+                    }
+                }
+            });
+        }
+    }
+
+    unsigned size() const { return static_cast<unsigned>(handles.size()); }
+
+    // The first exception thrown by a functor on any of the loops.
+    std::exception_ptr error() const
+    {
+        std::lock_guard<std::mutex> lock(failure_mutex);
+        return failure;
+    }
+
+private:
+    std::vector<detail::loop_handle*> handles;
+    std::vector<std::thread> threads;
+    mutable std::mutex failure_mutex;
+    mutable std::exception_ptr failure;
+
+    friend class tcp_acceptor;
+};
+
+}
@@ -0,0 +1,188 @@
+/*
+* Copyright(c) 2017 Catalin Mihai Ghita
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files(the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions :
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <uv.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace wave {
+namespace detail {
+
+// Helper living as long as its loop, created on first use. close()
+// releases its libuv handles once the loop has nothing left to run.
+struct loop_service
+{
+    virtual ~loop_service() {}
+    virtual void close() {}
+};
+
+struct loop_handle
+{
+    loop_handle()
+        : loop(&own_loop)
+        , pending(0)
+        , connections(0)
+    {
+        uv_loop_init(loop);
+        init();
+    }
+
+    loop_handle(uv_loop_t* l)
+        : loop(l)
+        , pending(0)
+        , connections(0)
+    {
+        init();
+    }
+
+    ~loop_handle()
+    {
+        uv_close(reinterpret_cast<uv_handle_t*>(&wakeup), nullptr);
+        uv_run(loop, UV_RUN_DEFAULT);
+        for (auto& s : services) {
+            if (s) {
+                s->close();
+            }
+        }
+        uv_run(loop, UV_RUN_DEFAULT);
+        services.clear();
+        if (loop == &own_loop) {
+            uv_loop_close(loop);
+        }
+    }
+
+    void init()
+    {
+        wakeup.data = this;
+        uv_async_init(loop, &wakeup, wakeup_cb);
+        uv_unref(reinterpret_cast<uv_handle_t*>(&wakeup));
+    }
+
+    static loop_handle*& current()
+    {
+        static thread_local loop_handle* l = nullptr;
+        return l;
+    }
+
+    static void wakeup_cb(uv_async_t* handle)
+    {
+        auto p = static_cast<loop_handle*>(handle->data);
+        std::vector<std::function<void()>> tasks;
+        {
+            std::unique_lock<std::mutex> lk(p->tasks_mutex);
+            tasks.swap(p->tasks);
+        }
+        for (auto& task : tasks) {
+            task();
+        }
+    }
+
+    void run()
+    {
+        uv_run(loop, UV_RUN_DEFAULT);
+    }
+
+    // Thread safe, the task runs on the loop thread.
+    void post(std::function<void()> task)
+    {
+        {
+            std::unique_lock<std::mutex> lk(tasks_mutex);
+            tasks.push_back(std::move(task));
+        }
+        uv_async_send(&wakeup);
+    }
+
+    // Keeps the loop alive while waiting for posted tasks.
+    // Both must be called from the loop thread.
+    void hold()
+    {
+        if (pending++ == 0) {
+            uv_ref(reinterpret_cast<uv_handle_t*>(&wakeup));
+        }
+    }
+
+    void release()
+    {
+        if (--pending == 0) {
+            uv_unref(reinterpret_cast<uv_handle_t*>(&wakeup));
+        }
+    }
+
+    template <typename T>
+    T& service()
+    {
+        auto id = service_id<T>();
+        if (services.size() <= id) {
+            services.resize(id + 1);
+        }
+        if (!services[id]) {
+            services[id].reset(new T(*this));
+        }
+        return static_cast<T&>(*services[id]);
+    }
+
+    template <typename T>
+    static size_t service_id()
+    {
+        static const size_t id = next_service_id()++;
+        return id;
+    }
+
+    static std::atomic<size_t>& next_service_id()
+    {
+        static std::atomic<size_t> id{0};
+        return id;
+    }
+
+    uv_loop_t own_loop;
+    uv_loop_t* loop;
+    uv_async_t wakeup;
+    unsigned pending;
+    std::atomic<unsigned> connections;
+    std::mutex tasks_mutex;
+    std::vector<std::function<void()>> tasks;
+    std::vector<std::unique_ptr<loop_service>> services;
+};
+
+inline loop_handle& current_loop_handle()
+{
+    if (auto l = loop_handle::current()) {
+        return *l;
+    }
+    static loop_handle* default_handle = new loop_handle(uv_default_loop());
+    return *default_handle;
+}
+
+inline uv_loop_t* current_loop()
+{
+    return current_loop_handle().loop;
+}
+
+}
+}
@@ -0,0 +1,128 @@
+/*
+* Copyright(c) 2017 Catalin Mihai Ghita
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files(the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions :
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include "wave.h"
+
+#include "executor.h"
+#include "worker.h"
+#include "parallel_private.h"
+
+namespace wave {
+
+// Runs f for up to n upstream events at once on the libuv pool and emits
+// the results on the loop in the order the events came.
+template <typename F>
+decltype(auto) parallel_map(size_t n, F&& f)
+{
+    return detail::parallel_map_t<std::decay_t<F>, true>{ n, std::forward<F>(f), nullptr };
+}
+
+template <typename F>
+decltype(auto) parallel_map(const executor& pool, size_t n, F&& f)
+{
+    return detail::parallel_map_t<std::decay_t<F>, true>{ n, std::forward<F>(f), detail::executor_access::handle(pool) };
+}
+
+// Emits the results as soon as they are ready.
+template <typename F>
+decltype(auto) parallel_map_unordered(size_t n, F&& f)
+{
+    return detail::parallel_map_t<std::decay_t<F>, false>{ n, std::forward<F>(f), nullptr };
+}
+
+template <typename F>
+decltype(auto) parallel_map_unordered(const executor& pool, size_t n, F&& f)
+{
+    return detail::parallel_map_t<std::decay_t<F>, false>{ n, std::forward<F>(f), detail::executor_access::handle(pool) };
+}
+
+template <typename F
+         ,bool Ordered
+         ,typename U
+         ,typename State = detail::parallel_state<F, std::decay_t<U>, Ordered>>
+detail::parallel_stage<State> operator>>=(detail::parallel_map_t<F, Ordered>&& p, U&& u)
+{
+    return detail::parallel_stage<State>{ std::make_shared<State>(std::move(p), std::forward<U>(u)) };
+}
+
+namespace detail {
+
+template <typename Index, typename F>
+decltype(auto) start_parallel_for(Index first, Index last, Index grain, F&& f,
+                                  std::shared_ptr<executor_handle> pool)
+{
+    typedef batch_handle<Index, for_body<std::decay_t<F>>> handle_type;
+    auto h = new handle_type(first, last, grain, { std::forward<F>(f) }, std::move(pool));
+    h->submit();
+    return worker_finished_source(h);
+}
+
+template <typename Index, typename T, typename F, typename Combine>
+decltype(auto) start_parallel_reduce(Index first, Index last, Index grain, T init, F&& f, Combine&& combine,
+                                     std::shared_ptr<executor_handle> pool)
+{
+    typedef reduce_body<T, std::decay_t<F>, std::decay_t<Combine>> body_type;
+    typedef batch_handle<Index, body_type, T> handle_type;
+    auto h = new handle_type(first, last, grain,
+                             { init, std::forward<F>(f), std::forward<Combine>(combine), {} },
+                             std::move(pool));
+    h->body.partials.assign(h->chunks, init);
+    h->submit();
+    return typename worker_source<T>::type(h);
+}
+
+}
+
+// Calls f for every index of [first, last) in chunks of grain indices and
+// completes once all of them ran.
+template <typename Index, typename F>
+decltype(auto) parallel_for(Index first, Index last, Index grain, F&& f)
+{
+    return detail::start_parallel_for(first, last, grain, std::forward<F>(f), nullptr);
+}
+
+template <typename Index, typename F>
+decltype(auto) parallel_for(const executor& pool, Index first, Index last, Index grain, F&& f)
+{
+    return detail::start_parallel_for(first, last, grain, std::forward<F>(f), detail::executor_access::handle(pool));
+}
+
+// Emits combine applied over init and f of every index of [first, last).
+// Chunks start from init, so it should be the identity of combine.
+template <typename Index, typename T, typename F, typename Combine>
+decltype(auto) parallel_reduce(Index first, Index last, Index grain, T init, F&& f, Combine&& combine)
+{
+    return detail::start_parallel_reduce(first, last, grain, std::move(init), std::forward<F>(f),
+                                         std::forward<Combine>(combine), nullptr);
+}
+
+template <typename Index, typename T, typename F, typename Combine>
+decltype(auto) parallel_reduce(const executor& pool, Index first, Index last, Index grain, T init, F&& f, Combine&& combine)
+{
+    return detail::start_parallel_reduce(first, last, grain, std::move(init), std::forward<F>(f),
+                                         std::forward<Combine>(combine), detail::executor_access::handle(pool));
+}
+
+}
@@ -0,0 +1,454 @@
+/*
+* Copyright(c) 2017 Catalin Mihai Ghita
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files(the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions :
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <uv.h>
+
+#include "executor_private.h"
+#include "loop_private.h"
+#include "pool_private.h"
+#include "wave_private.h"
+#include "worker_private.h"
+
+namespace wave {
+namespace detail {
+
+template <typename L, typename Seq = typename L::args_index_sequence>
+struct args_tuple;
+
+template <typename L, size_t... I>
+struct args_tuple<L, std::index_sequence<I...>>
+{
+    typedef std::tuple<std::decay_t<typename L::template arg<I>::type>...> type;
+};
+
+// Result computed on a worker thread and handed to the loop.
+template <typename R>
+struct parallel_result
+{
+    parallel_result()
+        : valid(false)
+    {}
+
+    ~parallel_result()
+    {
+        if (valid) {
+            reinterpret_cast<R*>(&storage)->~R();
+        }
+    }
+
+    template <typename F, typename Tuple, size_t... I>
+    void compute(const F& f, Tuple& args, std::index_sequence<I...>)
+    {
+        new (&storage) R(f(std::move(std::get<I>(args))...));
+        valid = true;
+    }
+
+    template <typename U>
+    void emit(U& u)
+    {
+        u(std::move(*reinterpret_cast<R*>(&storage)));
+    }
+
+    typename std::aligned_storage<sizeof(R), alignof(R)>::type storage;
+    bool valid;
+};
+
+template <>
+struct parallel_result<void>
+{
+    template <typename F, typename Tuple, size_t... I>
+    void compute(const F& f, Tuple& args, std::index_sequence<I...>)
+    {
+        f(std::move(std::get<I>(args))...);
+    }
+
+    template <typename U>
+    void emit(U& u)
+    {
+        u();
+    }
+};
+
+template <typename F, bool Ordered>
+struct parallel_map_t
+{
+    size_t limit;
+    F f;
+    std::shared_ptr<executor_handle> pool;
+};
+
+// Runs up to limit upstream events at once on worker threads. Ordered
+// stages park early results in a ring indexed by sequence number and emit
+// them in arrival order; events beyond the limit wait in a backlog.
+template <typename F, typename U, bool Ordered>
+struct parallel_state : public std::enable_shared_from_this<parallel_state<F, U, Ordered>>
+{
+    typedef lambda<F> traits;
+    typedef typename traits::result_type result_type;
+    typedef typename args_tuple<traits>::type args_type;
+
+    struct request : public pooled
+    {
+        template <typename... Args>
+        request(Args&&... args)
+            : args(std::forward<Args>(args)...)
+            , next(nullptr)
+        {
+            work.data = this;
+        }
+
+        uv_work_t work;
+        std::shared_ptr<parallel_state> state;
+        size_t seq;
+        args_type args;
+        parallel_result<result_type> result;
+        std::exception_ptr error;
+        request* next;
+    };
+
+    parallel_state(parallel_map_t<F, Ordered>&& p, U u)
+        : f(std::move(p.f))
+        , u(std::move(u))
+        , pool(std::move(p.pool))
+        , owner(&current_loop_handle())
+        , limit(p.limit ? p.limit : 1)
+        , started(0)
+        , emitted(0)
+        , outstanding(0)
+        , ring(Ordered ? limit : 0, nullptr)
+        , backlog(nullptr)
+        , backlog_tail(nullptr)
+    {}
+
+    ~parallel_state()
+    {
+        drop_backlog();
+    }
+
+    template <typename... Args>
+    void push(Args&&... args)
+    {
+        if (failure) {
+            std::rethrow_exception(failure);
+        }
+        auto r = new request(std::forward<Args>(args)...);
+        if (outstanding < limit) {
+            start(r);
+        } else if (backlog_tail) {
+            backlog_tail->next = r;
+            backlog_tail = r;
+        } else {
+            backlog = backlog_tail = r;
+        }
+    }
+
+    void start(request* r)
+    {
+        r->seq = started++;
+        ++outstanding;
+        r->state = this->shared_from_this();
+        if (pool) {
+            owner->hold();
+            pool->submit([r]() {
+                work_cb(&r->work);
+                auto owner = r->state->owner;
+                owner->post([r, owner]() {
+                    owner->release();
+                    after_work_cb(&r->work, 0);
+                });
+            });
+        } else {
+            uv_queue_work(owner->loop, &r->work, work_cb, after_work_cb);
+        }
+    }
+
+    static void work_cb(uv_work_t* work)
+    {
+        auto r = static_cast<request*>(work->data);
+        try {
+            r->result.compute(r->state->f, r->args, typename traits::args_index_sequence{});
+        } catch (...) {
+            r->error = std::current_exception();
+        }
+    }
+
+    static void after_work_cb(uv_work_t* work, int)
+    {
+        auto r = static_cast<request*>(work->data);
+        auto s = std::move(r->state);
+        s->complete(r);
+    }
+
+    void complete(request* r)
+    {
+        if (Ordered) {
+            ring[r->seq % limit] = r;
+            while (auto next = ring[emitted % limit]) {
+                ring[emitted % limit] = nullptr;
+                ++emitted;
+                emit(next);
+            }
+        } else {
+            emit(r);
+        }
+        while (backlog && outstanding < limit) {
+            auto next = backlog;
+            backlog = next->next;
+            if (!backlog) {
+                backlog_tail = nullptr;
+            }
+            start(next);
+        }
+    }
+
+    // A failure drops the pending events and ends the upstream
+    // subscription on its next event.
+    void emit(request* r)
+    {
+        --outstanding;
+        if (!failure) {
+            try {
+                if (r->error) {
+                    std::rethrow_exception(r->error);
+                }
+                r->result.emit(u);
+            } catch (...) {
+                failure = std::current_exception();
+                drop_backlog();
+            }
+        }
+        delete r;
+    }
+
+    void drop_backlog()
+    {
+        while (auto r = backlog) {
+            backlog = r->next;
+            delete r;
+        }
+        backlog_tail = nullptr;
+    }
+
+    F f;
+    U u;
+    std::shared_ptr<executor_handle> pool;
+    loop_handle* owner;
+    size_t limit;
+    size_t started;
+    size_t emitted;
+    size_t outstanding;
+    std::vector<request*> ring;
+    request* backlog;
+    request* backlog_tail;
+    std::exception_ptr failure;
+};
+
+template <typename State>
+struct parallel_stage
+{
+    template <typename... Args>
+    void operator()(Args&&... args) const
+    {
+        state->push(std::forward<Args>(args)...);
+    }
+
+    std::shared_ptr<State> state;
+};
+
+// Splits [first, last) into chunks of grain indices run across a pool.
+// Chunks only count down, the continuation fires once, after the last one.
+template <typename Index, typename Body, typename... R>
+struct batch_handle : public result_worker_handle<R...>
+{
+    batch_handle(Index first, Index last, Index grain, Body body, std::shared_ptr<executor_handle> pool)
+        : first(first)
+        , last(last)
+        , grain(grain > 0 ? grain : 1)
+        , chunks(last > first ? static_cast<size_t>((last - first + this->grain - 1) / this->grain) : 1)
+        , body(std::move(body))
+        , owner(&current_loop_handle())
+        , remaining(chunks)
+        , failed(false)
+    {
+        this->work.after_work_cb = default_after_work_cb;
+        this->executor = std::move(pool);
+    }
+
+    // Separate from the constructor so derived handles are complete.
+    void submit()
+    {
+        if (this->executor) {
+            owner->hold();
+            std::vector<std::function<void()>> tasks;
+            tasks.reserve(chunks);
+            for (size_t k = 0; k < chunks; ++k) {
+                tasks.emplace_back([this, k]() {
+                    run_chunk(k);
+                    if (remaining.fetch_sub(1) == 1) {
+                        owner->post([this]() {
+                            owner->release();
+                            finish();
+                        });
+                    }
+                });
+            }
+            this->executor->submit(std::move(tasks));
+        } else {
+            requests.resize(chunks);
+            for (auto& r : requests) {
+                r.data = this;
+                uv_queue_work(owner->loop, &r, chunk_work_cb, chunk_after_work_cb);
+            }
+        }
+    }
+
+    void cancel() override
+    {
+        this->cancelled = true;
+    }
+
+    static void chunk_work_cb(uv_work_t* req)
+    {
+        auto h = static_cast<batch_handle*>(req->data);
+        h->run_chunk(req - h->requests.data());
+    }
+
+    static void chunk_after_work_cb(uv_work_t* req, int)
+    {
+        auto h = static_cast<batch_handle*>(req->data);
+        if (h->remaining.fetch_sub(1) == 1) {
+            h->finish();
+        }
+    }
+
+    void run_chunk(size_t k)
+    {
+        if (this->cancelled || failed) {
+            return;
+        }
+        auto begin = first + static_cast<Index>(k) * grain;
+        auto end = std::min<Index>(begin + grain, last);
+        try {
+            body.run(k, begin, end);
+        } catch (...) {
+            std::lock_guard<std::mutex> lk(error_mutex);
+            if (!failed) {
+                failed = true;
+                this->error = std::current_exception();
+            }
+        }
+    }
+
+    void finish()
+    {
+        int status = this->cancelled ? UV_ECANCELED : 0;
+        if (status == 0 && !failed) {
+            try {
+                this->run(body);
+            } catch (...) {
+                this->error = std::current_exception();
+            }
+        }
+        this->work.after_work_cb(&this->work, status);
+    }
+
+    static void default_after_work_cb(uv_work_t* handle, int)
+    {
+        delete static_cast<batch_handle*>(handle->data);
+    }
+
+    Index first;
+    Index last;
+    Index grain;
+    size_t chunks;
+    Body body;
+    loop_handle* owner;
+    std::vector<uv_work_t> requests;
+    std::atomic<size_t> remaining;
+    std::atomic<bool> failed;
+    std::mutex error_mutex;
+};
+
+// Calls f for every index, nothing is emitted.
+template <typename F>
+struct for_body
+{
+    template <typename Index>
+    void run(size_t, Index begin, Index end) const
+    {
+        for (auto i = begin; i < end; ++i) {
+            f(i);
+        }
+    }
+
+    void operator()() const
+    {}
+
+    F f;
+};
+
+// Every chunk folds its indices into its own partial, the partials are
+// combined on the loop in index order.
+template <typename T, typename F, typename Combine>
+struct reduce_body
+{
+    template <typename Index>
+    void run(size_t k, Index begin, Index end)
+    {
+        auto acc = init;
+        for (auto i = begin; i < end; ++i) {
+            acc = combine(std::move(acc), f(i));
+        }
+        partials[k] = std::move(acc);
+    }
+
+    T operator()()
+    {
+        auto acc = init;
+        for (auto& p : partials) {
+            acc = combine(std::move(acc), std::move(p));
+        }
+        return acc;
+    }
+
+    T init;
+    F f;
+    Combine combine;
+    std::vector<T> partials;
+};
+
+}
+}
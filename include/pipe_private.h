@@ -28,6 +28,8 @@
 
 #include <uv.h>
 
+#include "loop_private.h"
+
 #include "memory.h"
 #include "stream_private.h"
 
@@ -55,7 +57,7 @@ struct pipe_handle : public stream_handle
 
     void init()
     {
-        uv_pipe_init(uv_default_loop(), &pipe, 1);
+        uv_pipe_init(current_loop(), &pipe, 1);
         stream_handle::init(reinterpret_cast<uv_stream_t*>(&pipe));
         close_cb = pipe_close_cb;
     }
@@ -0,0 +1,179 @@
+/*
+* Copyright(c) 2017 Catalin Mihai Ghita
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files(the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions :
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+
+namespace wave {
+namespace detail {
+
+// Size class slab allocator for handles and callbacks.
+// Every loop thread owns its free lists, so the hot path takes no lock.
+// Slabs are never returned to the system: blocks may be freed on another
+// thread and the free lists of exiting threads go back to a shared depot.
+class pool
+{
+public:
+    enum {
+        min_size = 32,
+        max_size = 1024,
+        classes = 6,
+        slab_size = 64 * 1024
+    };
+
+    ~pool()
+    {
+        auto& d = depot();
+        std::unique_lock<std::mutex> lk(d.mutex);
+        for (unsigned i = 0; i < classes; ++i) {
+            while (auto b = free_lists[i]) {
+                free_lists[i] = b->next;
+                b->next = d.free_lists[i];
+                d.free_lists[i] = b;
+            }
+        }
+    }
+
+    static pool& local()
+    {
+        static thread_local pool p;
+        return p;
+    }
+
+    void* allocate(size_t size)
+    {
+        auto c = size_class(size);
+        if (c == classes) {
+            return ::operator new(size);
+        }
+        auto b = free_lists[c];
+        if (!b) {
+            b = refill(c);
+        }
+        free_lists[c] = b->next;
+        return b;
+    }
+
+    void deallocate(void* p, size_t size)
+    {
+        auto c = size_class(size);
+        if (c == classes) {
+            ::operator delete(p);
+            return;
+        }
+        auto b = static_cast<block*>(p);
+        b->next = free_lists[c];
+        free_lists[c] = b;
+    }
+
+private:
+    struct block
+    {
+        block* next;
+    };
+
+    struct shared_depot
+    {
+        std::mutex mutex;
+        block* free_lists[classes] = {};
+    };
+
+    static shared_depot& depot()
+    {
+        static shared_depot* d = new shared_depot();
+        return *d;
+    }
+
+    static unsigned size_class(size_t size)
+    {
+        unsigned c = 0;
+        for (size_t s = min_size; c < classes && s < size; s <<= 1) {
+            ++c;
+        }
+        return c;
+    }
+
+    block* refill(unsigned c)
+    {
+        auto& d = depot();
+        {
+            std::unique_lock<std::mutex> lk(d.mutex);
+            if (auto b = d.free_lists[c]) {
+                d.free_lists[c] = nullptr;
+                return b;
+            }
+        }
+        size_t size = static_cast<size_t>(min_size) << c;
+        auto slab = static_cast<char*>(::operator new(slab_size));
+        block* head = nullptr;
+        for (size_t offset = slab_size; offset >= size; offset -= size) {
+            auto b = reinterpret_cast<block*>(slab + offset - size);
+            b->next = head;
+            head = b;
+        }
+        return head;
+    }
+
+    block* free_lists[classes] = {};
+};
+
+inline void* allocate(size_t size)
+{
+#ifndef WAVE_NO_POOL
+    return pool::local().allocate(size);
+#else
+    return ::operator new(size);
+#endif
+}
+
+inline void deallocate(void* p, size_t size)
+{
+#ifndef WAVE_NO_POOL
+    pool::local().deallocate(p, size);
+#else
+    ::operator delete(p);
+#endif
+}
+
+// Base for objects living on a loop, routes their allocations through the
+// pool of the thread that creates or destroys them.
+struct pooled
+{
+#ifndef WAVE_NO_POOL
+    static void* operator new(size_t size)
+    {
+        return allocate(size);
+    }
+
+    static void operator delete(void* p, size_t size)
+    {
+        deallocate(p, size);
+    }
+#endif
+};
+
+}
+}
@@ -0,0 +1,49 @@
+/*
+* Copyright(c) 2017 Catalin Mihai Ghita
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files(the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions :
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include "post_private.h"
+
+namespace wave {
+
+// Runs f on the current loop once the I/O callbacks of the coming poll
+// are done, without allocating a handle. Only from the loop's own thread,
+// loop::post hands work over from other threads.
+template <typename F>
+void post_local(F&& f)
+{
+    detail::current_loop_handle().service<detail::microtask_queue>()
+        .post(detail::make_posted(std::forward<F>(f)));
+}
+
+// Runs f on the current loop right before it next polls for I/O, also
+// only from the loop's own thread.
+template <typename F>
+void defer(F&& f)
+{
+    detail::current_loop_handle().service<detail::microtask_queue>()
+        .defer(detail::make_posted(std::forward<F>(f)));
+}
+
+}
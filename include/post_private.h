@@ -0,0 +1,201 @@
+/*
+* Copyright(c) 2017 Catalin Mihai Ghita
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files(the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions :
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <utility>
+
+#include <uv.h>
+
+#include "loop_private.h"
+#include "pool_private.h"
+
+namespace wave {
+namespace detail {
+
+struct posted_task : public pooled
+{
+    posted_task()
+        : next(nullptr)
+    {}
+
+    virtual ~posted_task() {}
+    virtual void run() = 0;
+
+    posted_task* next;
+};
+
+template <typename F>
+struct posted_functor : public posted_task
+{
+    posted_functor(F f)
+        : functor(std::move(f))
+    {}
+
+    void run() override
+    {
+        functor();
+    }
+
+    F functor;
+};
+
+struct task_list
+{
+    task_list()
+        : head(nullptr)
+        , tail(&head)
+    {}
+
+    void push(posted_task* t)
+    {
+        *tail = t;
+        tail = &t->next;
+    }
+
+    posted_task* take()
+    {
+        auto t = head;
+        head = nullptr;
+        tail = &head;
+        return t;
+    }
+
+    bool empty() const
+    {
+        return head == nullptr;
+    }
+
+    posted_task* head;
+    posted_task** tail;
+};
+
+// Continuations of one loop. Posted ones run in the check phase, after
+// the next poll, deferred ones in the prepare phase, before it.
+// Both handles stay started but unreferenced, an idle handle keeps the
+// loop from blocking in poll while anything is queued.
+struct microtask_queue : public loop_service
+{
+    microtask_queue(loop_handle& l)
+    {
+        uv_check_init(l.loop, &check);
+        uv_prepare_init(l.loop, &prepare);
+        uv_idle_init(l.loop, &idle);
+        check.data = prepare.data = idle.data = this;
+        uv_check_start(&check, check_cb);
+        uv_prepare_start(&prepare, prepare_cb);
+        uv_unref(reinterpret_cast<uv_handle_t*>(&check));
+        uv_unref(reinterpret_cast<uv_handle_t*>(&prepare));
+    }
+
+    void close() override
+    {
+        uv_close(reinterpret_cast<uv_handle_t*>(&check), nullptr);
+        uv_close(reinterpret_cast<uv_handle_t*>(&prepare), nullptr);
+        uv_close(reinterpret_cast<uv_handle_t*>(&idle), nullptr);
+    }
+
+    ~microtask_queue()
+    {
+        discard(posted.take());
+        discard(deferred.take());
+    }
+
+    void post(posted_task* t)
+    {
+        posted.push(t);
+        wake();
+    }
+
+    void defer(posted_task* t)
+    {
+        deferred.push(t);
+        wake();
+    }
+
+    void wake()
+    {
+        if (!uv_is_active(reinterpret_cast<uv_handle_t*>(&idle))) {
+            uv_idle_start(&idle, [](uv_idle_t*) {});
+        }
+    }
+
+    void settle()
+    {
+        if (posted.empty() && deferred.empty()) {
+            uv_idle_stop(&idle);
+        }
+    }
+
+    // Tasks queued while draining wait for the next pass.
+    static void drain(posted_task* t)
+    {
+        while (t) {
+            auto next = t->next;
+            try {
+                t->run();
+            } catch (...) {
+            }
+            delete t;
+            t = next;
+        }
+    }
+
+    static void discard(posted_task* t)
+    {
+        while (t) {
+            auto next = t->next;
+            delete t;
+            t = next;
+        }
+    }
+
+    static void check_cb(uv_check_t* handle)
+    {
+        auto q = static_cast<microtask_queue*>(handle->data);
+        drain(q->posted.take());
+        q->settle();
+    }
+
+    static void prepare_cb(uv_prepare_t* handle)
+    {
+        auto q = static_cast<microtask_queue*>(handle->data);
+        drain(q->deferred.take());
+        q->settle();
+    }
+
+    uv_check_t check;
+    uv_prepare_t prepare;
+    uv_idle_t idle;
+    task_list posted;
+    task_list deferred;
+};
+
+template <typename F>
+posted_task* make_posted(F&& f)
+{
+    return new posted_functor<std::decay_t<F>>(std::forward<F>(f));
+}
+
+}
+}
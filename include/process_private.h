@@ -28,17 +28,20 @@
 
 #include <uv.h>
 
+#include "loop_private.h"
+#include "pool_private.h"
+
 #include "wave.h"
 #include "pipe.h"
 
 namespace wave {
 namespace detail {
 
-struct process_handle
+struct process_handle : public pooled
 {
     uv_process_t process;
     uv_process_options_t options{0};
-    std::unique_ptr<callback> exit_cb;
+    callback exit_cb;
     detail::pipe_handle* stdin_pipe{nullptr};
     detail::pipe_handle* stdout_pipe{nullptr};
     detail::pipe_handle* stderr_pipe{nullptr};
@@ -90,7 +93,7 @@ struct process_handle
         options.stdio = child_stdio;
         options.stdio_count = 3;
 
-        if (uv_spawn(uv_default_loop(), &process, &options)) {
+        if (uv_spawn(current_loop(), &process, &options)) {
             throw std::runtime_error("Process " + *list.begin() + " spawn failed");
         }
     }
@@ -121,19 +124,19 @@ struct process_handle
 };
 
 template <class F>
-struct process_finished : public callback
+struct process_finished
 {
+    static callback& slot(process_handle& h) { return h.exit_cb; }
+
     process_finished(F&& f, process_handle* h)
         : functor(std::move(f))
     {
-        h->exit_cb.reset(this);
         h->process.exit_cb = cb;
     }
 
     process_finished(const F& f, process_handle* h)
         : functor(f)
     {
-        h->exit_cb.reset(this);
         h->process.exit_cb = cb;
     }
 
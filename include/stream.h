@@ -22,6 +22,8 @@
 
 #pragma once
 
+#include "buffer.h"
+#include "cancel.h"
 #include "stream_private.h"
 #include "wave.h"
 
@@ -31,9 +33,9 @@ class end_stream
 {
 };
 
-using stream_read_source = source<detail::stream_handle*, detail::stream_read, std::string>;
+using stream_read_source = source<detail::stream_handle*, detail::stream_read, buffer>;
 using stream_wrote_source = source<detail::stream_handle*, detail::stream_write>;
-using stream_connected_source = source<detail::stream_handle*, detail::stream_write>;
+using stream_connected_source = source<detail::stream_handle*, detail::stream_connect>;
 
 class stream : public stream_read_source
 {
@@ -53,6 +55,25 @@ public:
 
     void shutdown() const { handle->shutdown(); }
     void stop_reading() const { handle->stop_reading(); }
+    void small_first_read() const { handle->small_first_read(); }
+    void pause_reading() const { handle->pause_reading(); }
+    void resume_reading() const { handle->resume_reading(); }
+
+    // Pauses reading from upstream while this stream has more than
+    // high bytes left to write, until it drains below low.
+    void throttle(const stream& upstream, size_t high = 64 * 1024, size_t low = 16 * 1024) const
+    {
+        handle->throttle(upstream.handle, high, low);
+    }
+
+    size_t pending_bytes() const { return handle->pending_bytes; }
+
+    void idle_timeout(uint64_t timeout) const { handle->idle_timeout(timeout); }
+
+    void cancel_on(const cancellation& token) const
+    {
+        handle->cancel_on(detail::cancel_access::state(token));
+    }
     void close() const { handle->close(); }
 
 protected:
@@ -25,25 +25,87 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <uv.h>
 
+#include "buffer.h"
+#include "cancel_private.h"
+#include "post_private.h"
+#include "wheel_private.h"
+#include "pool_private.h"
+
 #include "memory.h"
+#include "wave_private.h"
 
 namespace wave {
 namespace detail {
-struct stream_handle
+
+// Buffers written by one uv_write, kept alive until its callback.
+struct write_request : public pooled
+{
+    uv_write_t req;
+    std::vector<write_chunk> data;
+    std::vector<uv_buf_t> bufs;
+    write_request* next;
+};
+
+struct stream_handle;
+
+// Reports the writes completed by uv_try_write from the loop, after the
+// writing call returned. Detached if the stream goes away first.
+struct write_report : public posted_task
+{
+    write_report(stream_handle* owner)
+        : owner(owner)
+    {}
+
+    void run() override;
+
+    stream_handle* owner;
+};
+
+struct stream_handle : public pooled
 {
     stream_handle()
         : stream{nullptr}
+        , read_size{0}
+        , writing{nullptr}
+        , queued{nullptr}
+        , free_requests{nullptr}
+        , reporting{false}
+        , written{0}
+        , pending_report{nullptr}
+        , paused{false}
+        , pending_bytes{0}
+        , high_water{0}
+        , low_water{0}
+        , upstream{nullptr}
+        , downstream{nullptr}
+        , idle_ms{0}
+        , wheel{nullptr}
     {}
 
+    virtual ~stream_handle()
+    {
+        if (wheel) {
+            wheel->cancel(&idle_entry);
+        }
+        if (pending_report) {
+            pending_report->owner = nullptr;
+        }
+        cancel_write();
+        while (auto r = free_requests) {
+            free_requests = r->next;
+            delete r;
+        }
+    }
+
     void init(uv_stream_t* s)
     {
         stream = s;
         stream->data = this;
-        write_handle.data = this;
-        write_handle.cb = default_write_cb;
+        wrote_cb = default_wrote_cb;
         stream->alloc_cb = default_alloc_cb;
         stream->read_cb = nullptr;
         connect_handle.data = this;
@@ -58,12 +120,84 @@ struct stream_handle
     void stop_reading()
     {
         uv_read_stop(reinterpret_cast<uv_stream_t*>(stream));
+        paused = false;
         read_cb.reset();
     }
 
+    // Stops reading but keeps the subscription for resume_reading.
+    void pause_reading()
+    {
+        if (read_cb.get() && !paused) {
+            // uv_read_stop forgets the callbacks, keep them for resuming.
+            paused_alloc_cb = stream->alloc_cb;
+            paused_read_cb = stream->read_cb;
+            uv_read_stop(stream);
+            paused = true;
+        }
+    }
+
+    void resume_reading()
+    {
+        if (paused) {
+            paused = false;
+            uv_read_start(stream, paused_alloc_cb, paused_read_cb);
+        }
+    }
+
+    // Pauses the upstream reads while more than high bytes wait to be
+    // written here, and resumes them once at most low bytes are left.
+    void throttle(stream_handle* source, size_t high, size_t low)
+    {
+        unthrottle();
+        if (source->downstream) {
+            source->downstream->unthrottle();
+        }
+        upstream = source;
+        upstream->downstream = this;
+        high_water = high;
+        low_water = low;
+        update_pressure();
+    }
+
+    void unthrottle()
+    {
+        if (upstream) {
+            upstream->downstream = nullptr;
+            upstream->resume_reading();
+            upstream = nullptr;
+        }
+    }
+
+    void update_pressure()
+    {
+        if (!upstream) {
+            return;
+        }
+        if (pending_bytes > high_water) {
+            upstream->pause_reading();
+        } else if (pending_bytes <= low_water) {
+            upstream->resume_reading();
+        }
+    }
+
+    // Drops the writes not yet handed to the stream.
     void cancel_write()
     {
-        uv_cancel(reinterpret_cast<uv_req_t*>(&write_handle));
+        if (queued) {
+            pending_bytes -= queued_bytes(queued);
+            release(queued);
+            queued = nullptr;
+            update_pressure();
+        }
+    }
+
+    static size_t queued_bytes(write_request* r)
+    {
+        size_t n = 0;
+        for (auto& d : r->data) {
+            n += d.buf().len;
+        }
+        return n;
     }
 
     void shutdown()
@@ -77,9 +211,8 @@ struct stream_handle
         });
     }
 
-    static void default_write_cb(uv_write_t *req, int status)
+    static void default_wrote_cb(stream_handle* p, int status, unsigned)
     {
-        auto p = static_cast<stream_handle*>(req->data);
         if (status != 0) {
             p->close();
         }
@@ -96,21 +229,199 @@ struct stream_handle
         delete static_cast<stream_handle*>(handle->data);
     }
 
+    // Writes go straight to the socket when nothing is pending, only the
+    // unwritten tail is queued. Writes issued while another one is in
+    // flight are coalesced into a single vectored uv_write.
     template <typename String>
     void write(String&& s)
     {
-        data = std::forward<String>(s);
-        buff = uv_buf_init(const_cast<char*>(data.data()), data.size());
-        uv_write(&write_handle, stream, &buff, 1, write_handle.cb);
+        if (!writing && !queued && !reporting) {
+            auto b = to_buf(s);
+            auto n = uv_try_write(stream, &b, 1);
+            if (n == static_cast<int>(b.len)) {
+                active();
+                report_later();
+                return;
+            }
+            if (n > 0) {
+                queued = acquire();
+                queued->data.emplace_back(std::forward<String>(s));
+                queued->data.back().advance(n);
+                pending_bytes += b.len - n;
+                flush();
+                update_pressure();
+                return;
+            }
+        }
+        if (!queued) {
+            queued = acquire();
+        }
+        queued->data.emplace_back(std::forward<String>(s));
+        pending_bytes += queued->data.back().buf().len;
+        if (!writing) {
+            flush();
+        }
+        update_pressure();
+    }
+
+    void flush()
+    {
+        auto r = queued;
+        queued = nullptr;
+        for (auto& d : r->data) {
+            r->bufs.push_back(d.buf());
+        }
+        writing = r;
+        auto status = uv_write(&r->req, stream, r->bufs.data(), r->bufs.size(), write_done);
+        if (status != 0) {
+            write_done(&r->req, status);
+        }
+    }
+
+    static void write_done(uv_write_t* req, int status)
+    {
+        auto p = static_cast<stream_handle*>(req->data);
+        auto count = static_cast<unsigned>(p->writing->data.size());
+        for (auto& b : p->writing->bufs) {
+            p->pending_bytes -= b.len;
+        }
+        p->release(p->writing);
+        p->writing = nullptr;
+        if (status == 0 && p->queued) {
+            p->flush();
+        }
+        p->update_pressure();
+        if (status == 0) {
+            p->active();
+        }
+        p->report_written();
+        p->report(status, count);
+    }
+
+    void report_later()
+    {
+        ++written;
+        if (!pending_report) {
+            pending_report = new write_report(this);
+            current_loop_handle().service<microtask_queue>().post(pending_report);
+        }
+    }
+
+    // Writes done by uv_try_write are reported before any later uv_write.
+    void report_written()
+    {
+        if (pending_report) {
+            pending_report->owner = nullptr;
+            pending_report = nullptr;
+        }
+        if (auto n = written) {
+            written = 0;
+            report(0, n);
+        }
+    }
+
+    // Writes completed while reporting are queued, keeping wrote() in order.
+    void report(int status, unsigned count)
+    {
+        reporting = true;
+        wrote_cb(this, status, count);
+        reporting = false;
+    }
+
+    write_request* acquire()
+    {
+        auto r = free_requests;
+        if (r) {
+            free_requests = r->next;
+        } else {
+            r = new write_request();
+            r->req.data = this;
+        }
+        return r;
+    }
+
+    void release(write_request* r)
+    {
+        r->data.clear();
+        r->bufs.clear();
+        r->next = free_requests;
+        free_requests = r;
+    }
+
+    // Starts with the smallest read slab and adapts to the traffic,
+    // so mostly idle streams never pin the full suggested size.
+    void small_first_read()
+    {
+        read_size = slab_pool::min_size;
+    }
+
+    void adapt_read_size(size_t nread, size_t capacity)
+    {
+        if (!read_size) {
+            return;
+        }
+        if (nread == capacity) {
+            read_size = slab_pool::round(capacity + 1);
+        } else if (nread < capacity / 8 && capacity > slab_pool::min_size) {
+            read_size = capacity / 4;
+        }
     }
 
     void start_reading()
     {
+        paused = false;
         uv_read_start(stream, stream->alloc_cb, stream->read_cb);
     }
 
+    // Drops the pending writes and closes when the token fires, which
+    // also aborts a connect in progress.
+    void cancel_on(std::shared_ptr<cancel_state> token)
+    {
+        cancel_hook.link(std::move(token), this, [](void* p) {
+            auto h = static_cast<stream_handle*>(p);
+            h->cancel_write();
+            h->close();
+        });
+    }
+
+    // Closes the stream after timeout milliseconds without reading or
+    // writing anything, zero turns it off.
+    void idle_timeout(uint64_t timeout)
+    {
+        if (!wheel) {
+            wheel = &current_loop_handle().service<timer_wheel>();
+            idle_entry.owner = this;
+            idle_entry.fn = [](wheel_entry* e) {
+                auto h = static_cast<stream_handle*>(e->owner);
+                h->cancel_write();
+                h->close();
+            };
+        }
+        idle_ms = timeout;
+        if (idle_ms) {
+            wheel->schedule(&idle_entry, idle_ms);
+        } else {
+            wheel->cancel(&idle_entry);
+        }
+    }
+
+    void active()
+    {
+        if (idle_ms) {
+            wheel->schedule(&idle_entry, idle_ms);
+        }
+    }
+
     void close()
     {
+        unthrottle();
+        if (wheel) {
+            idle_ms = 0;
+            wheel->cancel(&idle_entry);
+        }
+        if (downstream) {
+            downstream->unthrottle();
+        }
         connect_cb.reset();
         if (!uv_is_closing(reinterpret_cast<uv_handle_t*>(stream))) {
             uv_close(reinterpret_cast<uv_handle_t*>(stream), close_cb);
@@ -118,78 +429,125 @@ struct stream_handle
     }
 
     uv_stream_t* stream;
+    size_t read_size;
     uv_shutdown_t shutdown_handle;
     uv_connect_t connect_handle;
-    uv_write_t write_handle;
-    uv_buf_t buff;
-    std::string data;
-    std::unique_ptr<callback> connect_cb;
-    std::unique_ptr<callback> read_cb;
-    std::unique_ptr<callback> write_cb;
+    write_request* writing;
+    write_request* queued;
+    write_request* free_requests;
+    bool reporting;
+    unsigned written;
+    write_report* pending_report;
+    bool paused;
+    uv_alloc_cb paused_alloc_cb;
+    uv_read_cb paused_read_cb;
+    size_t pending_bytes;
+    size_t high_water;
+    size_t low_water;
+    stream_handle* upstream;
+    stream_handle* downstream;
+    void (*wrote_cb)(stream_handle*, int, unsigned);
+    callback connect_cb;
+    callback read_cb;
+    callback write_cb;
+    cancel_registration cancel_hook;
+    wheel_entry idle_entry;
+    uint64_t idle_ms;
+    timer_wheel* wheel;
     uv_close_cb close_cb;
 };
 
+inline void write_report::run()
+{
+    if (owner) {
+        owner->report_written();
+    }
+}
+
 template <typename F, typename S>
-struct stream_read : public callback
+struct stream_read
 {
+    static callback& slot(stream_handle& h) { return h.read_cb; }
+
     stream_read(F f, stream_handle* h)
         : functor(std::move(f))
     {
-        h->read_cb.reset(this);
         h->stream->alloc_cb = alloc_cb;
         h->stream->read_cb = cb;
         h->start_reading();
     }
 
+    // Read slabs come from the loop pool and go back to it after the
+    // callback, unless the functor retained a buffer pointing into them.
     static void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
     {
         auto h = static_cast<stream_handle*>(handle->data);
-        auto p = static_cast<stream_read*>(h->read_cb.get());
-        p->data.reserve(suggested_size);
-        *buf = uv_buf_init(const_cast<char*>(p->data.data()), suggested_size);
+        auto block = slab_pool::local().acquire(h->read_size ? h->read_size : suggested_size);
+        *buf = uv_buf_init(block->data(), block->capacity);
     }
 
     static void cb(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf)
     {
         auto h = static_cast<stream_handle*>(handle->data);
+        auto block = buf->base ? slab::from(buf->base) : nullptr;
         try {
             auto p = static_cast<stream_read*>(h->read_cb.get());
             if (nread < 0) {
-                throw std::exception();
+                // End of stream included, reported as UV_EOF.
+                fail(p->functor, static_cast<int>(nread));
+                h->stop_reading();
+            } else if (nread > 0) {
+                h->active();
+                h->adapt_read_size(nread, block->capacity);
+                p->functor(S(block, 0, nread));
             }
-            p->functor(std::string(buf->base, nread));
         }
         catch (...) {
             h->stop_reading();
         }
+        if (block) {
+            block->unref();
+        }
     }
 
     F functor;
-    std::vector<char> data;
 };
 
 template <typename F>
-struct stream_write : public callback
+struct stream_write
 {
+    static callback& slot(stream_handle& h) { return h.write_cb; }
+
     stream_write(F f, stream_handle* h)
         : functor(std::move(f))
     {
-        h->write_cb.reset(this);
-        h->write_handle.cb = cb;
+        h->wrote_cb = cb;
     }
 
-    static void cb(uv_write_t *req, int status)
+    // Fires once for every buffer of the completed write.
+    static void cb(stream_handle* h, int status, unsigned count)
     {
-        auto h = static_cast<stream_handle*>(req->data);
         try {
             if (status != 0) {
-                throw std::exception();
+                if (auto p = static_cast<stream_write*>(h->write_cb.get())) {
+                    fail(p->functor, status);
+                }
+                h->cancel_write();
+                h->wrote_cb = stream_handle::default_wrote_cb;
+                h->write_cb.reset();
+                return;
+            }
+            for (unsigned i = 0; i < count; ++i) {
+                auto p = static_cast<stream_write*>(h->write_cb.get());
+                if (!p) {
+                    break;
+                }
+                p->functor();
             }
-            auto p = static_cast<stream_write*>(h->write_cb.get());
-            p->functor();
         }
         catch (...) {
             h->cancel_write();
+            h->wrote_cb = stream_handle::default_wrote_cb;
             h->write_cb.reset();
         }
     }
@@ -198,12 +556,13 @@ struct stream_write : public callback
 
 
 template <typename F>
-struct stream_connect : public callback
+struct stream_connect
 {
+    static callback& slot(stream_handle& h) { return h.connect_cb; }
+
     stream_connect(F f, stream_handle* h)
         : functor(std::move(f))
     {
-        h->connect_cb.reset(this);
         h->connect_handle.cb = cb;
     }
 
@@ -211,10 +570,12 @@ struct stream_connect : public callback
     {
         auto h = static_cast<stream_handle*>(req->data);
         try {
+            auto p = static_cast<stream_connect*>(h->connect_cb.get());
             if (status != 0) {
-                throw std::exception();
+                fail(p->functor, status);
+                h->close();
+                return;
             }
-            auto p = static_cast<stream_connect*>(h->connect_cb.get());
             p->functor();
         }
         catch (...) {
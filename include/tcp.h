@@ -25,6 +25,8 @@
 #include "tcp_private.h"
 #include "wave.h"
 #include "stream.h"
+#include "tcp_flags.h"
+#include "loop.h"
 
 namespace wave {
 
@@ -43,6 +45,8 @@ private:
     {}
 
     friend class tcp_server;
+    template <typename, typename>
+    friend struct detail::tcp_handoff;
 };
 
 class tcp_server : public tcp_server_connected_source
@@ -52,8 +56,31 @@ public:
         : base(new detail::tcp_server_handle(port, max_connections))
     {}
 
+    tcp_server(int port, tcp_server_flags flags, int max_connections = SOMAXCONN)
+        : base(new detail::tcp_server_handle(port, max_connections, flags))
+    {}
+
     tcp_client accept() const { return tcp_client(handle->accept()); }
     void close() const { handle->close(); }
 };
 
+using tcp_acceptor_source = source<detail::tcp_server_handle*, detail::tcp_handoff, tcp_client>;
+
+// Accepts on the current loop and hands every connection
+// to the least loaded loop of the group.
+class tcp_acceptor : public tcp_acceptor_source
+{
+public:
+    tcp_acceptor(int port, const loop_group& workers, int max_connections = SOMAXCONN)
+        : base(new detail::tcp_server_handle(port, max_connections))
+    {
+        handle->workers = workers.handles;
+#ifdef _WIN32
+        handle->status = UV_ENOTSUP;
+#endif
+    }
+
+    void close() const { handle->close(); }
+};
+
 }
@@ -23,13 +23,22 @@
 #pragma once
 #include <iostream>
 
+#include <atomic>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <uv.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "loop_private.h"
+#include "pool_private.h"
 
 #include "memory.h"
 #include "stream_private.h"
+#include "tcp_flags.h"
 
 namespace wave {
 namespace detail {
@@ -48,31 +57,63 @@ struct tcp_client_handle : public stream_handle
         init();
     }
 
+    tcp_client_handle(uv_os_sock_t sock, loop_handle* owner)
+        : owner(owner)
+    {
+        init();
+        uv_tcp_open(&tcp, sock);
+    }
+
     void init()
     {
-        uv_tcp_init(uv_default_loop(), &tcp);
+        uv_tcp_init(current_loop(), &tcp);
         stream_handle::init(reinterpret_cast<uv_stream_t*>(&tcp));
         close_cb = tcp_close_cb;
     }
 
     static void tcp_close_cb(uv_handle_t* handle)
     {
-        delete static_cast<tcp_client_handle*>(handle->data);
+        auto p = static_cast<tcp_client_handle*>(handle->data);
+        if (p->owner) {
+            --p->owner->connections;
+        }
+        delete p;
     }
 
     uv_tcp_t tcp;
     sockaddr_in addr;
+    loop_handle* owner{nullptr};
 };
 
-struct tcp_server_handle
+struct tcp_server_handle : public pooled
 {
-    tcp_server_handle(int port, int maxcon)
+    tcp_server_handle(int port, int maxcon, int flags = 0)
     {
         uv_ip4_addr("0.0.0.0", port, &addr);
-        uv_tcp_init(uv_default_loop(), &tcp);
+        uv_tcp_init_ex(current_loop(), &tcp, AF_INET);
         tcp.data = this;
-        uv_tcp_bind(&tcp, reinterpret_cast<const struct sockaddr*>(&addr), 0);
-        uv_listen(reinterpret_cast<uv_stream_t*>(&tcp), maxcon, default_listen_cb);
+        status = flags & tcp_server_flags::reuse_port ? reuse_port() : 0;
+        if (status == 0) {
+            status = uv_tcp_bind(&tcp, reinterpret_cast<const struct sockaddr*>(&addr), 0);
+        }
+        if (status == 0) {
+            status = uv_listen(reinterpret_cast<uv_stream_t*>(&tcp), maxcon, default_listen_cb);
+        }
+    }
+
+    int reuse_port()
+    {
+#ifdef SO_REUSEPORT
+        uv_os_fd_t fd;
+        int on = 1;
+        if (uv_fileno(reinterpret_cast<uv_handle_t*>(&tcp), &fd) != 0
+                || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+            return UV_EINVAL;
+        }
+        return 0;
+#else
+        return UV_ENOTSUP;
+#endif
     }
 
     static void default_listen_cb(uv_stream_t *req, int status)
@@ -88,6 +129,38 @@ struct tcp_server_handle
         return client;
     }
 
+    // Accepts the pending connection and returns a duplicate of its socket
+    // that can be opened on another loop.
+    uv_os_sock_t detach()
+    {
+        uv_os_sock_t sock = -1;
+#ifndef _WIN32
+        auto client = accept();
+        uv_os_fd_t fd;
+        if (uv_fileno(reinterpret_cast<uv_handle_t*>(&client->tcp), &fd) == 0) {
+            sock = dup(fd);
+        }
+        client->close();
+#endif
+        return sock;
+    }
+
+    // Skipped workers are never picked, returns the number of workers
+    // when all of them are skipped.
+    unsigned least_loaded(const std::atomic<bool>* skip) const
+    {
+        unsigned best = static_cast<unsigned>(workers.size());
+        for (unsigned i = 0; i < workers.size(); ++i) {
+            if (!skip[i] && (best == workers.size() || workers[i]->connections < workers[best]->connections)) {
+                best = i;
+            }
+        }
+        if (best < workers.size()) {
+            ++workers[best]->connections;
+        }
+        return best;
+    }
+
     void close()
     {
         if (!uv_is_closing(reinterpret_cast<uv_handle_t*>(&tcp))) {
@@ -100,27 +173,37 @@ struct tcp_server_handle
 
     uv_tcp_t tcp;
     struct sockaddr_in addr;
-    std::unique_ptr<callback> listen_cb;
+    int status;
+    std::vector<loop_handle*> workers;
+    callback listen_cb;
 };
 
 template <typename F>
-struct tcp_listen : public callback
+struct tcp_listen
 {
+    static callback& slot(tcp_server_handle& h) { return h.listen_cb; }
+
     tcp_listen(F f, tcp_server_handle* server)
         : functor(std::move(f))
     {
-        server->listen_cb.reset(this);
         server->tcp.connection_cb = cb;
+        if (server->status != 0) {
+            fail(functor, server->status);
+            server->close();
+        }
     }
 
     static void cb(uv_stream_t *req, int status)
     {
         auto h = static_cast<tcp_server_handle*>(req->data);
         try {
+            auto p = static_cast<tcp_listen*>(h->listen_cb.get());
             if (status < 0) {
-                throw std::exception();
+                fail(p->functor, status);
+                h->close();
+                h->listen_cb.reset();
+                return;
             }
-            auto p = static_cast<tcp_listen*>(h->listen_cb.get());
             p->functor();
         }
         catch (...) {
@@ -131,5 +214,84 @@ struct tcp_listen : public callback
     F functor;
 };
 
+template <typename F, typename Client>
+struct tcp_handoff
+{
+    static callback& slot(tcp_server_handle& h) { return h.listen_cb; }
+
+    // Called from every worker loop, a worker whose call threw is skipped.
+    struct shared
+    {
+        shared(F f, size_t workers)
+            : functor(std::move(f))
+            , dropped(new std::atomic<bool>[workers])
+        {
+            for (size_t i = 0; i < workers; ++i) {
+                dropped[i] = false;
+            }
+        }
+
+        F functor;
+        std::unique_ptr<std::atomic<bool>[]> dropped;
+    };
+
+    tcp_handoff(F f, tcp_server_handle* server)
+        : state(std::make_shared<shared>(std::move(f), server->workers.size()))
+    {
+        server->tcp.connection_cb = cb;
+        if (server->status != 0) {
+            fail(state->functor, server->status);
+            server->close();
+        }
+    }
+
+    static void cb(uv_stream_t *req, int status)
+    {
+        auto h = static_cast<tcp_server_handle*>(req->data);
+        try {
+            auto p = static_cast<tcp_handoff*>(h->listen_cb.get());
+            if (status < 0) {
+                fail(p->state->functor, status);
+                h->close();
+                h->listen_cb.reset();
+                return;
+            }
+            auto index = h->least_loaded(p->state->dropped.get());
+            if (index == h->workers.size()) {
+                h->close();
+                h->listen_cb.reset();
+                return;
+            }
+            auto worker = h->workers[index];
+            auto sock = h->detach();
+            if (sock < 0) {
+                --worker->connections;
+                return;
+            }
+            auto state = p->state;
+            worker->post([state, index, worker, sock] {
+                Client client(new tcp_client_handle(sock, worker));
+                if (state->dropped[index]) {
+                    client.close();
+                    return;
+                }
+                try {
+                    state->functor(client);
+                } catch (...) {
+                    state->dropped[index] = true;
+                    client.close();
+                }
+            });
+        }
+        catch (...) {
+            h->close();
+            h->listen_cb.reset();
+        }
+    }
+
+    // The last worker to drop it runs the finalizer.
+    std::shared_ptr<shared> state;
+};
+
 }
 }
@@ -24,22 +24,46 @@
 
 #include <memory>
 
+#include "cancel.h"
 #include "timer_private.h"
 
 #include "wave.h"
 
 namespace wave {
 
-using tick_source = source<detail::timer_handle*, detail::ticking>;
+using tick_source = source<detail::timer_ref, detail::ticking>;
+using slack_stats = detail::slack_stats;
 
 class timer : public tick_source
 {
 public:
-    timer(unsigned long long timeout, unsigned times = 1)
-        : base{ new detail::timer_handle(timeout, times) }
+    // A slack in milliseconds lets the timer fire late to share a wakeup.
+    timer(unsigned long long timeout, unsigned times = 1, unsigned slack = 0)
+        : base{ detail::timer_ref(new detail::timer_handle(timeout, times, slack)) }
     {}
 
     void stop() const { handle->stop(); }
+
+    // Also after the last tick, until stop(). Nothing is allocated. The last
+    // tick drops the callback, subscribe again after restarting.
+    void restart(unsigned long long timeout) const { handle->restart(timeout); }
+    void again() const { handle->again(); }
+    void set_interval(unsigned long long interval) const { handle->set_interval(interval); }
+    unsigned long long interval() const { return uv_timer_get_repeat(&handle->timer); }
+
+    // Stops the timer when the token fires.
+    const timer& cancel_on(const cancellation& token) const
+    {
+        handle->cancel_on(detail::cancel_access::state(token));
+        return *this;
+    }
 };
 
+// Wakeups of the current loop's timers with slack, and the ticks that
+// shared one of them instead of waking the loop on their own.
+inline slack_stats timer_slack_stats()
+{
+    return detail::current_loop_handle().service<detail::timer_slack>().stats;
+}
+
 }
@@ -22,24 +22,205 @@
 
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
 #include <uv.h>
 
+#include "cancel_private.h"
+#include "loop_private.h"
+#include "pool_private.h"
+
 namespace wave {
 namespace detail {
 
-struct timer_handle
+struct slack_stats
+{
+    uint64_t wakeups;
+    uint64_t saved;
+};
+
+// Counts the wakeups of one loop's timers with slack. Their deadlines are
+// rounded up to a multiple of the slack on the loop clock, timers landing
+// on the same multiple expire in the same pass of libuv's timer heap.
+struct timer_slack : public loop_service
+{
+    timer_slack(loop_handle&)
+        : last(0)
+    {
+        stats.wakeups = 0;
+        stats.saved = 0;
+    }
+
+    static uint64_t align(uint64_t due, unsigned slack)
+    {
+        return (due + slack - 1) / slack * slack;
+    }
+
+    void fired(uint64_t aligned)
+    {
+        if (aligned == last) {
+            ++stats.saved;
+        } else {
+            ++stats.wakeups;
+            last = aligned;
+        }
+    }
+
+    uint64_t last;
+    slack_stats stats;
+};
+
+struct timer_handle;
+
+// Timers of one loop that are not closed yet. A callback holding its own
+// timer keeps the handle alive, those are closed with the loop.
+struct timer_registry : public loop_service
+{
+    timer_registry(loop_handle&)
+    {
+        head.prev = head.next = &head;
+    }
+
+    struct link
+    {
+        link* prev;
+        link* next;
+        timer_handle* owner;
+    };
+
+    void add(link* l)
+    {
+        l->next = &head;
+        l->prev = head.prev;
+        head.prev->next = l;
+        head.prev = l;
+    }
+
+    static void remove(link* l)
+    {
+        l->prev->next = l->next;
+        l->next->prev = l->prev;
+    }
+
+    std::size_t size() const
+    {
+        std::size_t n = 0;
+        for (auto l = head.next; l != &head; l = l->next) {
+            ++n;
+        }
+        return n;
+    }
+
+    void close() override;
+
+    link head;
+};
+
+// Counted by the timer objects and, while it runs, by itself. A timer that
+// ran its ticks stops and drops its callback, so it can be restarted for as
+// long as it is referenced. The uv_timer_t is closed once it is stopped or
+// unreferenced, the memory is freed when both happened.
+struct timer_handle : public pooled
 {
     uv_timer_t timer;
     unsigned times;
-    std::unique_ptr<callback> timer_cb;
+    unsigned initial_times;
+    unsigned slack;
+    unsigned refs;
+    bool armed;
+    bool rearmed;
+    bool closed;
+    bool released;
+    uint64_t due;
+    uint64_t aligned;
+    timer_slack* coalescer;
+    timer_registry::link registered;
+    callback timer_cb;
     std::exception_ptr cought_ex;
+    cancel_registration cancel_hook;
 
-    timer_handle(unsigned long long timeout, unsigned times = 1)
+    timer_handle(unsigned long long timeout, unsigned times = 1, unsigned slack = 0)
         : times(times)
+        , initial_times(times)
+        , slack(slack)
+        , refs(0)
+        , armed(false)
+        , rearmed(false)
+        , closed(false)
+        , released(false)
+        , due(0)
+        , aligned(0)
+        , coalescer(slack ? &current_loop_handle().service<timer_slack>() : nullptr)
     {
-        uv_timer_init(uv_default_loop(), &timer);
+        registered.owner = this;
+        current_loop_handle().service<timer_registry>().add(&registered);
+        uv_timer_init(current_loop(), &timer);
         timer.data = this;
-        uv_timer_start(&timer, default_timer_cb, timeout, timeout);
+        start(default_timer_cb, timeout, timeout);
+        arm();
+    }
+
+    void ref()
+    {
+        ++refs;
+    }
+
+    void unref()
+    {
+        if (--refs == 0) {
+            released = true;
+            if (closed) {
+                delete this;
+            } else {
+                stop();
+            }
+        }
+    }
+
+    // A running timer holds a reference to itself.
+    void arm()
+    {
+        if (!armed) {
+            armed = true;
+            ref();
+        }
+    }
+
+    void disarm()
+    {
+        if (armed) {
+            armed = false;
+            unref();
+        }
+    }
+
+    // With slack the timer may fire up to slack milliseconds late,
+    // together with the other timers due in the same window.
+    void start(uv_timer_cb cb, uint64_t timeout, uint64_t repeat)
+    {
+        if (slack) {
+            auto now = uv_now(timer.loop);
+            due = now + timeout;
+            aligned = timer_slack::align(due, slack);
+            uv_timer_start(&timer, cb, aligned - now, repeat);
+        } else {
+            uv_timer_start(&timer, cb, timeout, repeat);
+        }
+    }
+
+    // Next period counted from the previous deadline, not from the late tick.
+    void rearm()
+    {
+        auto now = uv_now(timer.loop);
+        due += uv_timer_get_repeat(&timer);
+        if (due < now) {
+            due = now;
+        }
+        aligned = timer_slack::align(due, slack);
+        uv_timer_start(&timer, timer.timer_cb, aligned - now, uv_timer_get_repeat(&timer));
     }
 
     static void default_timer_cb(uv_timer_t* handle)
@@ -48,34 +229,161 @@ struct timer_handle
         h->stop();
     }
 
+    void tick()
+    {
+        rearmed = false;
+        if (times > 0) {
+            --times;
+        }
+    }
+
+    // Last use of the handle from a tick, it may be freed here.
     void after()
     {
-        if (times > 0 && --times == 0) {
-            stop();
+        if (rearmed || closing()) {
+            return;
         }
+        if (initial_times > 0 && times == 0) {
+            // The callback may hold the timer, dropping it breaks the cycle.
+            // The finalizer may restart the timer, without the callback.
+            uv_timer_stop(&timer);
+            armed = false;
+            timer.timer_cb = default_timer_cb;
+            timer_cb.reset();
+            unref();
+        } else if (slack) {
+            rearm();
+        }
+    }
+
+    void cancel_on(std::shared_ptr<cancel_state> token)
+    {
+        cancel_hook.link(std::move(token), this, [](void* p) {
+            static_cast<timer_handle*>(p)->stop();
+        });
+    }
+
+    bool closing()
+    {
+        return uv_is_closing(reinterpret_cast<uv_handle_t*>(&timer)) != 0;
+    }
+
+    // Rearms the same uv_timer_t and callback, counting the ticks anew. After
+    // the last tick the callback is gone, the timer is subscribed again.
+    void restart(unsigned long long timeout)
+    {
+        if (!closing()) {
+            times = initial_times;
+            rearmed = true;
+            arm();
+            start(timer.timer_cb, timeout, timeout);
+        }
+    }
+
+    // Restarts with the current interval.
+    void again()
+    {
+        if (!closing()) {
+            times = initial_times;
+            rearmed = true;
+            arm();
+            if (slack) {
+                start(timer.timer_cb, uv_timer_get_repeat(&timer), uv_timer_get_repeat(&timer));
+            } else {
+                uv_timer_again(&timer);
+            }
+        }
+    }
+
+    // Used from the next tick on.
+    void set_interval(unsigned long long interval)
+    {
+        uv_timer_set_repeat(&timer, interval);
     }
 
+    // The callback is dropped once closed, unless the handle is freed
+    // first and drops it itself.
     void stop()
     {
-        if (!uv_is_closing(reinterpret_cast<uv_handle_t*>(&timer))) {
+        if (!closing()) {
             uv_timer_stop(&timer);
             uv_close(reinterpret_cast<uv_handle_t*>(&timer),
                      [](uv_handle_t* handle) {
                 auto p = static_cast<timer_handle*>(handle->data);
-                delete p;
+                timer_registry::remove(&p->registered);
+                p->closed = true;
+                if (p->released) {
+                    delete p;
+                } else {
+                    p->timer_cb.reset();
+                }
             });
+            disarm();
         }
     }
 };
 
+// Counted reference to a pooled timer_handle.
+class timer_ref
+{
+public:
+    explicit timer_ref(timer_handle* p)
+        : p(p)
+    {
+        p->ref();
+    }
+
+    timer_ref(const timer_ref& other)
+        : p(other.p)
+    {
+        p->ref();
+    }
+
+    timer_ref(timer_ref&& other) noexcept
+        : p(other.p)
+    {
+        other.p = nullptr;
+    }
+
+    timer_ref& operator=(timer_ref other) noexcept
+    {
+        std::swap(p, other.p);
+        return *this;
+    }
+
+    ~timer_ref()
+    {
+        if (p) {
+            p->unref();
+        }
+    }
+
+    timer_handle* operator->() const { return p; }
+    timer_handle& operator*() const { return *p; }
+
+private:
+    timer_handle* p;
+};
+
+inline void timer_registry::close()
+{
+    while (head.next != &head) {
+        auto l = head.next;
+        remove(l);
+        l->prev = l->next = l;
+        l->owner->stop();
+    }
+}
+
 template <class F>
-struct ticking : public callback
+struct ticking
 {
+    static callback& slot(timer_handle& h) { return h.timer_cb; }
+
     F functor;
-    ticking(F f, timer_handle* h)
+    ticking(F f, const timer_ref& h)
         : functor(std::move(f))
     {
-        h->timer_cb.reset(this);
         h->timer.timer_cb = cb;
     }
 
@@ -83,7 +391,11 @@ struct ticking : public callback
     {
         auto h = static_cast<timer_handle*>(handle->data);
         try {
+            if (h->coalescer) {
+                h->coalescer->fired(h->aligned);
+            }
             auto start = static_cast<ticking*>(h->timer_cb.get());
+            h->tick();
             start->functor();
             h->after();
         } catch (...) {
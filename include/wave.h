@@ -29,10 +29,12 @@
 #include <iostream>
 
 #include "wave_private.h"
+#include "loop.h"
 #include "async_private.h"
 
 #define $ [=]
 #define $finally || [=] () noexcept
+#define $error(status) || wave::detail::error_tag{} || [=] (int status) noexcept
 
 namespace wave {
 
@@ -56,13 +58,35 @@ M operator>>=(T&& t, U&& u)
 
 template <typename F
          ,typename Exit
-         ,typename = typename detail::lambda<std::decay_t<F>>::result_type>
+         ,typename = typename detail::lambda<std::decay_t<F>>::result_type
+         ,typename = decltype(std::declval<std::decay_t<Exit>&>()())>
 decltype(auto) operator||(F&& f, Exit&& exit)
 {
     static_assert(noexcept(exit()), "Exit function must not throw");
     return detail::closure<std::decay_t<F>, std::decay_t<Exit>>{std::forward<F>(f), std::forward<Exit>(exit)};
 }
 
+namespace detail {
+
+// $error expands to f || error_tag{} || handler, chained like $finally.
+template <typename F
+         ,typename = typename lambda<std::decay_t<F>>::result_type>
+error_pending<std::decay_t<F>> operator||(F&& f, error_tag)
+{
+    return error_pending<std::decay_t<F>>{std::forward<F>(f)};
+}
+
+template <typename F
+         ,typename Error
+         ,typename = decltype(std::declval<std::decay_t<Error>&>()(0))>
+error_closure<F, std::decay_t<Error>> operator||(error_pending<F>&& pending, Error&& error)
+{
+    static_assert(noexcept(error(0)), "Error function must not throw");
+    return error_closure<F, std::decay_t<Error>>{std::move(pending.f), std::forward<Error>(error)};
+}
+
+}
+
 template <typename Handle, template<typename...> class Callback, typename... Args>
 struct source : public detail::generic_source<Args...>
 {
@@ -71,7 +95,8 @@ struct source : public detail::generic_source<Args...>
     template <class F>
     void operator>>= (F&& functor) const
     {
-        new Callback<std::decay_t<F>, Args...>{ std::forward<F>(functor), handle };
+        typedef Callback<std::decay_t<F>, Args...> callback_type;
+        callback_type::slot(*handle).template emplace<callback_type>(std::forward<F>(functor), handle);
     }
 
     source(Handle handle)
@@ -98,33 +123,21 @@ public:
 
     void close() const
     {
-        handle->source_cb.reset();
+        handle->cb.reset();
     }
 
     template <typename F>
     void operator>>=(F&& f) const
     {
-        handle->cb.reset(
-            new detail::function_callback<std::decay_t<F>, T...>{
-                std::forward<F>(f),
-                handle.get()
-            });
+        handle->cb.template emplace<detail::function_callback<std::decay_t<F>, T...>>(
+            std::forward<F>(f),
+            handle.get());
     }
 
 private:
     std::shared_ptr<detail::function_handle<T...>> handle;
 };
 
-struct loop
-{
-
-    ~loop()
-    {
-        (void)uv_run(uv_default_loop(), UV_RUN_DEFAULT);
-        uv_loop_close(uv_default_loop());
-    }
-};
-
 template <typename T>
 class ref : public std::shared_ptr<T>
 {
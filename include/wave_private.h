@@ -23,14 +23,111 @@
 #pragma once
 
 #include <exception>
+#include <new>
+#include <type_traits>
 #include <utility>
 
+#include "pool_private.h"
+
 namespace wave {
 namespace detail {
 
-struct callback
+// Owns the functor subscribed to a handle. Small callbacks live inline in
+// the handle, larger ones fall back to the pool.
+class callback
 {
-    virtual ~callback() {}
+public:
+    enum { inline_size = 64 };
+
+    callback()
+        : object(nullptr)
+        , destroy(nullptr)
+    {}
+
+    callback(const callback&) = delete;
+    callback& operator=(const callback&) = delete;
+
+    ~callback()
+    {
+        if (object) {
+            destroy(object, false);
+        }
+    }
+
+    void* get() const
+    {
+        return object;
+    }
+
+    template <typename T, typename... Args>
+    T* emplace(Args&&... args)
+    {
+        reset();
+        typedef std::integral_constant<bool,
+            sizeof(T) <= sizeof(storage_type) && alignof(T) <= alignof(storage_type)> fits;
+        auto p = construct<T>(fits{}, std::forward<Args>(args)...);
+        object = p;
+        return p;
+    }
+
+    void reset()
+    {
+        if (auto p = object) {
+            object = nullptr;
+            destroy(p, true);
+        }
+    }
+
+private:
+    typedef typename std::aligned_storage<inline_size>::type storage_type;
+
+    template <typename T, typename... Args>
+    T* construct(std::true_type, Args&&... args)
+    {
+        auto p = new (&storage) T(std::forward<Args>(args)...);
+        destroy = destroy_inline<T>;
+        return p;
+    }
+
+    template <typename T, typename... Args>
+    T* construct(std::false_type, Args&&... args)
+    {
+        void* memory = allocate(sizeof(T));
+        T* p;
+        try {
+            p = new (memory) T(std::forward<Args>(args)...);
+        } catch (...) {
+            deallocate(memory, sizeof(T));
+            throw;
+        }
+        destroy = destroy_pooled<T>;
+        return p;
+    }
+
+    template <typename T>
+    static void destroy_inline(void* p, bool reset)
+    {
+        auto t = static_cast<T*>(p);
+        if (reset) {
+            // The callback may keep the handle owning this storage alive,
+            // so it is moved out before being destroyed.
+            T last(std::move(*t));
+            t->~T();
+        } else {
+            t->~T();
+        }
+    }
+
+    template <typename T>
+    static void destroy_pooled(void* p, bool)
+    {
+        static_cast<T*>(p)->~T();
+        deallocate(p, sizeof(T));
+    }
+
+    storage_type storage;
+    void* object;
+    void (*destroy)(void*, bool);
 };
 
 struct abstract_source
@@ -79,6 +176,57 @@ struct closure : public F
     bool valid;
 };
 
+// Functor with an $error handler, called with the libuv status that
+// ended its source. Statuses are reported without throwing.
+template <typename F, typename E>
+struct error_closure : public F
+{
+    error_closure(F&& f, E&& e)
+        : F(std::move(f))
+        , e(std::move(e))
+    {}
+
+    error_closure(const F& f, const E& e)
+        : F(f)
+        , e(e)
+    {}
+
+    void on_error(int status) noexcept
+    {
+        e(status);
+    }
+
+    E e;
+};
+
+struct error_tag
+{
+};
+
+template <typename F>
+struct error_pending
+{
+    F f;
+};
+
+template <typename F>
+auto fail(F& f, int status, int) -> decltype(f.on_error(status), void())
+{
+    f.on_error(status);
+}
+
+template <typename F>
+void fail(F&, int, long)
+{
+}
+
+// Sources call it before ending a subscription on an error status.
+template <typename F>
+void fail(F& f, int status)
+{
+    fail(f, status, 0);
+}
+
 template <typename T, typename U, typename R>
 struct map
 {
@@ -87,6 +235,13 @@ struct map
     {
         return u(t(std::forward<Args>(args)...));
     }
+
+    void on_error(int status) noexcept
+    {
+        fail(t, status);
+        fail(u, status);
+    }
+
     T t; U u;
 };
 
@@ -99,9 +254,17 @@ struct map<T, U, void>
         t(std::forward<Args>(args)...);
         return u();
     }
+
+    void on_error(int status) noexcept
+    {
+        fail(t, status);
+        fail(u, status);
+    }
+
     T t; U u;
 };
 
+// Errors of the sources returned by t go to the copies of u subscribed to them.
 template <typename T, typename U>
 struct flat_map
 {
@@ -111,6 +274,12 @@ struct flat_map
         auto source = t(std::forward<Args>(args)...);
         source >>= u;
     }
+
+    void on_error(int status) noexcept
+    {
+        fail(t, status);
+    }
+
     T t; U u;
 };
 
@@ -122,11 +291,11 @@ struct function_handle
     {}
 
     void(*f)(void*, T...);
-    std::unique_ptr<callback> cb;
+    callback cb;
 };
 
 template <typename F, typename... T>
-struct function_callback : public callback
+struct function_callback
 {
     function_callback(F f, function_handle<T...>* h)
         : functor(std::move(f))
@@ -0,0 +1,53 @@
+/*
+* Copyright(c) 2017 Catalin Mihai Ghita
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files(the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions :
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <memory>
+
+#include "wheel_private.h"
+
+#include "wave.h"
+
+namespace wave {
+
+using wheel_tick_source = source<std::shared_ptr<detail::wheel_timer_handle>, detail::wheel_ticking>;
+
+// One shot timer kept in the loop's timing wheel. Scheduling, pushing
+// back and cancelling are constant time, which suits one timeout per
+// connection. Resolution is one millisecond.
+class wheel_timer : public wheel_tick_source
+{
+public:
+    wheel_timer(uint64_t timeout)
+        : base{ std::shared_ptr<detail::wheel_timer_handle>(new detail::wheel_timer_handle()) }
+    {
+        handle->schedule(timeout);
+    }
+
+    // Moves the deadline to timeout milliseconds from now.
+    void reschedule(uint64_t timeout) const { handle->schedule(timeout); }
+    void cancel() const { handle->cancel(); }
+};
+
+}
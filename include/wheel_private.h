@@ -0,0 +1,315 @@
+/*
+* Copyright(c) 2017 Catalin Mihai Ghita
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files(the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions :
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include <uv.h>
+
+#include "loop_private.h"
+#include "pool_private.h"
+#include "wave_private.h"
+
+namespace wave {
+namespace detail {
+
+// Node of a wheel slot list.
+struct wheel_entry
+{
+    wheel_entry()
+        : prev(nullptr)
+        , next(nullptr)
+        , expires(0)
+        , owner(nullptr)
+        , fn(nullptr)
+    {}
+
+    bool linked() const
+    {
+        return next != nullptr;
+    }
+
+    void unlink()
+    {
+        prev->next = next;
+        next->prev = prev;
+        prev = next = nullptr;
+    }
+
+    wheel_entry* prev;
+    wheel_entry* next;
+    uint64_t expires;
+    void* owner;
+    void (*fn)(wheel_entry*);
+};
+
+// Hierarchical timing wheel of millisecond ticks, one per loop. Four
+// levels of 64 slots cover about 4.6 hours; entries move one level down
+// every time the level below wraps. Scheduling and cancelling only touch
+// a list, a single uv_timer_t wakes the loop for the next busy slot.
+struct timer_wheel : public loop_service
+{
+    enum {
+        levels = 4,
+        bits = 6,
+        slots = 1 << bits
+    };
+
+    timer_wheel(loop_handle& l)
+        : current(0)
+        , count(0)
+        , armed(false)
+        , armed_at(0)
+    {
+        uv_timer_init(l.loop, &timer);
+        timer.data = this;
+        start = uv_now(l.loop);
+        for (auto& level : wheel) {
+            for (auto& slot : level) {
+                slot.prev = slot.next = &slot;
+            }
+        }
+    }
+
+    void close() override
+    {
+        uv_close(reinterpret_cast<uv_handle_t*>(&timer), nullptr);
+    }
+
+    uint64_t now() const
+    {
+        return uv_now(timer.loop) - start;
+    }
+
+    // Fires e->fn after at least timeout milliseconds.
+    void schedule(wheel_entry* e, uint64_t timeout)
+    {
+        if (e->linked()) {
+            e->unlink();
+        } else if (count++ == 0 && now() > current) {
+            // Nothing is pending, skip the ticks of the idle period.
+            current = now();
+        }
+        uint64_t max = (uint64_t(1) << (bits * levels)) - 1;
+        e->expires = now() + (timeout ? (timeout < max ? timeout : max) : 1);
+        if (e->expires < current) {
+            e->expires = current;
+        }
+        insert(e);
+        if (!armed || e->expires < armed_at) {
+            arm();
+        }
+    }
+
+    void cancel(wheel_entry* e)
+    {
+        if (e->linked()) {
+            e->unlink();
+            --count;
+        }
+    }
+
+    void insert(wheel_entry* e)
+    {
+        auto delta = e->expires - current;
+        unsigned level = 0;
+        while (level + 1 < levels && delta >= (uint64_t(1) << (bits * (level + 1)))) {
+            ++level;
+        }
+        auto& slot = wheel[level][(e->expires >> (bits * level)) & (slots - 1)];
+        e->next = &slot;
+        e->prev = slot.prev;
+        slot.prev->next = e;
+        slot.prev = e;
+    }
+
+    // Moves the entries of the level slot reached by current one level down.
+    void cascade(unsigned level)
+    {
+        if (level >= levels) {
+            return;
+        }
+        auto index = (current >> (bits * level)) & (slots - 1);
+        wheel_entry pending;
+        splice(wheel[level][index], pending);
+        while (pending.next != &pending) {
+            auto e = pending.next;
+            e->unlink();
+            insert(e);
+        }
+        if (index == 0) {
+            cascade(level + 1);
+        }
+    }
+
+    static void splice(wheel_entry& from, wheel_entry& to)
+    {
+        if (from.next == &from) {
+            to.prev = to.next = &to;
+            return;
+        }
+        to.next = from.next;
+        to.prev = from.prev;
+        to.next->prev = &to;
+        to.prev->next = &to;
+        from.prev = from.next = &from;
+    }
+
+    void tick()
+    {
+        auto index = current & (slots - 1);
+        if (index == 0) {
+            cascade(1);
+        }
+        wheel_entry due;
+        splice(wheel[0][index], due);
+        ++current;
+        while (due.next != &due) {
+            auto e = due.next;
+            e->unlink();
+            --count;
+            e->fn(e);
+        }
+    }
+
+    // Wakes up at the next busy slot of the first level, or where it
+    // wraps and the next level cascades.
+    void arm()
+    {
+        if (!count) {
+            uv_timer_stop(&timer);
+            armed = false;
+            return;
+        }
+        auto index = current & (slots - 1);
+        auto target = current + (slots - index);
+        for (auto i = index; i < slots; ++i) {
+            if (wheel[0][i].next != &wheel[0][i]) {
+                target = current + (i - index);
+                break;
+            }
+        }
+        auto n = now();
+        armed = true;
+        armed_at = target;
+        uv_timer_start(&timer, timer_cb, target > n ? target - n : 0, 0);
+    }
+
+    static void timer_cb(uv_timer_t* handle)
+    {
+        auto w = static_cast<timer_wheel*>(handle->data);
+        w->armed = false;
+        auto n = w->now();
+        while (w->current <= n) {
+            w->tick();
+        }
+        w->arm();
+    }
+
+    uv_timer_t timer;
+    uint64_t start;
+    uint64_t current;
+    size_t count;
+    bool armed;
+    uint64_t armed_at;
+    wheel_entry wheel[levels][slots];
+};
+
+struct wheel_timer_handle : public pooled, public std::enable_shared_from_this<wheel_timer_handle>
+{
+    wheel_timer_handle()
+        : wheel(&current_loop_handle().service<timer_wheel>())
+        , fire(nullptr)
+    {
+        entry.owner = this;
+        entry.fn = fired;
+    }
+
+    ~wheel_timer_handle()
+    {
+        if (entry.linked()) {
+            wheel->cancel(&entry);
+        }
+    }
+
+    void schedule(uint64_t timeout)
+    {
+        wheel->schedule(&entry, timeout);
+        self = shared_from_this();
+    }
+
+    void cancel()
+    {
+        wheel->cancel(&entry);
+        auto keep_alive = std::move(self);
+        timer_cb.reset();
+    }
+
+    // One shot, the callback is dropped unless it scheduled again.
+    static void fired(wheel_entry* e)
+    {
+        auto h = static_cast<wheel_timer_handle*>(e->owner);
+        auto keep_alive = std::move(h->self);
+        if (auto f = h->fire) {
+            f(h);
+        }
+        if (!e->linked()) {
+            h->timer_cb.reset();
+        }
+    }
+
+    wheel_entry entry;
+    timer_wheel* wheel;
+    void (*fire)(wheel_timer_handle*);
+    callback timer_cb;
+    std::shared_ptr<wheel_timer_handle> self;
+};
+
+template <typename F>
+struct wheel_ticking
+{
+    static callback& slot(wheel_timer_handle& h) { return h.timer_cb; }
+
+    wheel_ticking(F f, const std::shared_ptr<wheel_timer_handle>& h)
+        : functor(std::move(f))
+    {
+        h->fire = cb;
+    }
+
+    static void cb(wheel_timer_handle* h)
+    {
+        try {
+            auto p = static_cast<wheel_ticking*>(h->timer_cb.get());
+            p->functor();
+        } catch (...) {
+            h->cancel();
+        }
+    }
+
+    F functor;
+};
+
+}
+}
@@ -22,22 +22,55 @@
 
 #pragma once
 
+#include "cancel.h"
+#include "executor.h"
 #include "worker_private.h"
 
 namespace wave
 {
 
-using worker_finished_source = source<detail::base_worker_handle*, detail::work_start>;
+using worker_finished_source = source<detail::result_worker_handle<>*, detail::work_start>;
 
+namespace detail {
+
+template <typename R>
+struct worker_source
+{
+    typedef source<result_worker_handle<R>*, work_start, R> type;
+};
+
+template <>
+struct worker_source<void>
+{
+    typedef worker_finished_source type;
+};
+
+}
+
+// Emits the value returned by the task on the loop thread.
 template <typename Task>
-class worker : public worker_finished_source
+class worker : public detail::worker_source<std::result_of_t<Task&()>>::type
 {
 public:
+    typedef typename detail::worker_source<std::result_of_t<Task&()>>::type base;
+
     worker(Task task)
         : base(new detail::worker_handle<Task>(std::move(task)))
     {}
 
-    void cancel() const { handle->cancel(); }
+    worker(Task task, const executor& pool, work_priority lane = normal)
+        : base(new detail::worker_handle<Task>(std::move(task), detail::executor_access::handle(pool), lane))
+    {}
+
+    void cancel() const { this->handle->cancel(); }
+
+    // Tasks not started when the token fires are skipped, running ones
+    // can poll the token.
+    const worker& cancel_on(const cancellation& token) const
+    {
+        this->handle->cancel_on(detail::cancel_access::state(token));
+        return *this;
+    }
 };
 
 template <typename Task>
@@ -46,4 +79,16 @@ decltype(auto) queue_work(Task&& task)
     return worker<std::decay_t<Task>>(std::forward<Task>(task));
 }
 
+template <typename Task>
+decltype(auto) queue_work(const executor& pool, Task&& task)
+{
+    return worker<std::decay_t<Task>>(std::forward<Task>(task), pool);
+}
+
+template <typename Task>
+decltype(auto) queue_work(const executor& pool, work_priority lane, Task&& task)
+{
+    return worker<std::decay_t<Task>>(std::forward<Task>(task), pool, lane);
+}
+
 }
@@ -22,46 +22,166 @@
 
 #pragma once
 
+#include <atomic>
+#include <exception>
 #include <memory>
+#include <new>
+#include <type_traits>
 
 #include <uv.h>
 
+#include "cancel_private.h"
+#include "executor_private.h"
+#include "loop_private.h"
+#include "pool_private.h"
+
 #include "wave.h"
 
 namespace wave {
 namespace detail {
 
-struct base_worker_handle
+struct base_worker_handle : public pooled
 {
     uv_work_t work;
-    std::unique_ptr<callback> after_cb;
+    callback after_cb;
+    std::shared_ptr<executor_handle> executor;
+    std::atomic<bool> cancelled;
+    cancel_registration cancel_hook;
 
     base_worker_handle()
+        : cancelled(false)
     {
         work.data = this;
     }
 
-    void cancel()
+    virtual ~base_worker_handle() {}
+
+    void cancel_on(std::shared_ptr<cancel_state> token)
+    {
+        cancel_hook.link(std::move(token), this, [](void* p) {
+            static_cast<base_worker_handle*>(p)->cancel();
+        });
+    }
+
+    // Tasks of an executor are skipped if they did not start yet.
+    virtual void cancel()
     {
-        uv_cancel(reinterpret_cast<uv_req_t*>(&work));
+        if (executor) {
+            cancelled = true;
+        } else {
+            uv_cancel(reinterpret_cast<uv_req_t*>(&work));
+        }
     }
 };
 
-template<typename Task>
-struct worker_handle : public base_worker_handle
+// Carries the value returned by the task, or what it threw, from the
+// worker thread to the continuation.
+template <typename... R>
+struct result_worker_handle;
+
+template <>
+struct result_worker_handle<> : public base_worker_handle
+{
+    template <typename Task>
+    void run(Task& task)
+    {
+        task();
+    }
+
+    template <typename F>
+    void emit(F& functor)
+    {
+        functor();
+    }
+
+    std::exception_ptr error;
+};
+
+template <typename R>
+struct result_worker_handle<R> : public base_worker_handle
+{
+    result_worker_handle()
+        : valid(false)
+    {}
+
+    ~result_worker_handle()
+    {
+        if (valid) {
+            reinterpret_cast<R*>(&storage)->~R();
+        }
+    }
+
+    template <typename Task>
+    void run(Task& task)
+    {
+        new (&storage) R(task());
+        valid = true;
+    }
+
+    template <typename F>
+    void emit(F& functor)
+    {
+        functor(std::move(*reinterpret_cast<R*>(&storage)));
+    }
+
+    typename std::aligned_storage<sizeof(R), alignof(R)>::type storage;
+    bool valid;
+    std::exception_ptr error;
+};
+
+template <typename R>
+struct worker_result
+{
+    typedef result_worker_handle<R> handle_type;
+};
+
+template <>
+struct worker_result<void>
+{
+    typedef result_worker_handle<> handle_type;
+};
+
+template<typename Task, typename Base = typename worker_result<std::result_of_t<Task&()>>::handle_type>
+struct worker_handle : public Base
 {
     Task task;
 
     worker_handle(Task task)
         : task(std::move(task))
     {
-        uv_queue_work(uv_default_loop(), &work, default_work_cb, default_after_work_cb);
+        uv_queue_work(current_loop(), &this->work, default_work_cb, default_after_work_cb);
+    }
+
+    // Runs on the executor, the result is posted back to this loop and
+    // reported through the same after_work_cb libuv would call.
+    worker_handle(Task task, std::shared_ptr<executor_handle> pool, work_priority lane = normal)
+        : task(std::move(task))
+    {
+        this->executor = std::move(pool);
+        this->work.after_work_cb = default_after_work_cb;
+        auto owner = &current_loop_handle();
+        owner->hold();
+        this->executor->submit([this, owner]() {
+            int status = UV_ECANCELED;
+            if (!this->cancelled) {
+                default_work_cb(&this->work);
+                status = 0;
+            }
+            owner->post([this, owner, status]() {
+                owner->release();
+                this->work.after_work_cb(&this->work, status);
+            });
+        }, lane);
     }
 
     static void default_work_cb(uv_work_t* handle)
     {
         auto p = static_cast<worker_handle*>(handle->data);
-        p->task();
+        try {
+            p->run(p->task);
+        } catch (...) {
+            p->error = std::current_exception();
+        }
     }
 
     static void default_after_work_cb(uv_work_t* handle, int status)
@@ -70,25 +190,33 @@ struct worker_handle : public base_worker_handle
     }
 };
 
-template <typename F>
-struct work_start : public callback
+template <typename F, typename... R>
+struct work_start
 {
+    static callback& slot(base_worker_handle& h) { return h.after_cb; }
+
     work_start(F f, base_worker_handle* h)
         : functor(std::move(f))
     {
-        h->after_cb.reset(this);
         h->work.after_work_cb = cb;
     }
 
+    // The handle is deleted inside the catch, so a $finally of the
+    // functor sees what the task threw.
     static void cb(uv_work_t* handle, int status)
     {
-        auto h = static_cast<base_worker_handle*>(handle->data);
+        auto h = static_cast<result_worker_handle<R...>*>(handle->data);
         try {
             if (status != 0) {
-                throw std::exception();
+                fail(static_cast<work_start*>(h->after_cb.get())->functor, status);
+                delete h;
+                return;
+            }
+            if (h->error) {
+                std::rethrow_exception(h->error);
             }
             auto p = static_cast<work_start*>(h->after_cb.get());
-            p->functor();
+            h->emit(p->functor);
             delete h;
         }
         catch (...) {
@@ -25,6 +25,7 @@
 #include "async.h"
 #include "file.h"
 #include "idle.h"
+#include "loop.h"
 #include "merge.h"
 #include "process.h"
 #include "tcp.h"
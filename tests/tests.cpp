@@ -20,21 +20,33 @@
 * SOFTWARE.
 */
 
+#include <array>
+#include <atomic>
 #include <exception>
+#include <map>
+#include <mutex>
 #include <thread>
 
 #include <gtest/gtest.h>
 
 #include <wave.h>
+#include <loop.h>
 #include <idle.h>
 #include <timer.h>
 #include <async.h>
 #include <worker.h>
+#include <executor.h>
+#include <parallel.h>
 #include <merge.h>
 #include <stream.h>
 #include <zip.h>
 #include <file.h>
 #include <tcp.h>
+#include <buffer.h>
+#include <cancel.h>
+#include <wheel.h>
+#include <hires_timer.h>
+#include <post.h>
 
 template<typename T>
 struct spy
@@ -81,6 +93,17 @@ TEST(SourceTests, Exception)
     s(2);
 }
 
+TEST(PoolTests, Reuse)
+{
+    using namespace wave;
+    auto& pool = detail::pool::local();
+    auto p1 = pool.allocate(100);
+    pool.deallocate(p1, 100);
+    auto p2 = pool.allocate(120);
+    EXPECT_EQ(p1, p2);
+    pool.deallocate(p2, 120);
+}
+
 TEST(MergeTests, Callback)
 {
     using namespace wave;
@@ -125,6 +148,29 @@ TEST(FlatMapTests, Callback)
     };
 }
 
+TEST(BufferTests, Slice)
+{
+    using namespace wave;
+    buffer b{ std::string("acasa") };
+    auto s = b.slice(1, 3);
+    EXPECT_EQ(s.size(), 3u);
+    EXPECT_EQ(s.data(), b.data() + 1);
+    EXPECT_EQ(std::string(s), "cas");
+    EXPECT_EQ(b.slice(4).str(), "a");
+    EXPECT_TRUE(b.slice(9).empty());
+}
+
+TEST(BufferTests, PoolRecycle)
+{
+    using namespace wave::detail;
+    auto s = slab_pool::local().acquire(100);
+    EXPECT_EQ(s->capacity, 1024u);
+    s->unref();
+    auto t = slab_pool::local().acquire(1000);
+    EXPECT_EQ(s, t);
+    t->unref();
+}
+
 TEST(FileTests, Reader)
 {
     using namespace wave;
@@ -168,6 +214,48 @@ TEST(TimerTests, Callback)
 }
 
 
+TEST(LoopTests, Group)
+{
+    using namespace wave;
+    auto main_id = std::this_thread::get_id();
+    auto count = std::make_shared<std::atomic<int>>(0);
+    {
+        loop_group group{ 2 };
+        EXPECT_EQ(group.size(), 2u);
+        group >>= $(unsigned) {
+            EXPECT_NE(main_id, std::this_thread::get_id());
+            return timer{ 1, 2 };
+        } >>= ${
+            (*count)++;
+        };
+    }
+    EXPECT_EQ(count->load(), 4);
+}
+
+TEST(LoopTests, GroupFinalizer)
+{
+    using namespace wave;
+    auto called = std::make_shared<std::atomic<int>>(0);
+    auto finalized = std::make_shared<std::atomic<int>>(0);
+    {
+        loop_group group{ 3 };
+        group >>= $(unsigned index) {
+            (*called)++;
+            if (index == 0) {
+                throw std::runtime_error("failed");
+            }
+        } $finally {
+            (*finalized)++;
+        };
+        while (*finalized == 0) {
+            std::this_thread::yield();
+        }
+        EXPECT_TRUE(group.error() != nullptr);
+    }
+    EXPECT_GE(called->load(), 1);
+    EXPECT_EQ(finalized->load(), 1);
+}
+
 TEST(AsyncTests, Affinity)
 {
     using namespace wave;
@@ -186,6 +274,190 @@ TEST(AsyncTests, Affinity)
     };
 }
 
+TEST(ExecutorTests, QueueWork)
+{
+    using namespace wave;
+    spy<int> finished{ 100, 0 };
+    loop loop;
+    executor pool{ 2 };
+    auto main_id = std::this_thread::get_id();
+    auto done = std::make_shared<int>(0);
+    for (int i = 0; i < 100; ++i) {
+        queue_work(pool, ${
+            EXPECT_NE(main_id, std::this_thread::get_id());
+        }) >>= ${
+            EXPECT_EQ(main_id, std::this_thread::get_id());
+            finished.inform(++(*done));
+        };
+    }
+    EXPECT_EQ(pool.size(), 2u);
+}
+
+TEST(ExecutorTests, Priority)
+{
+    using namespace wave;
+    spy<std::string> order{ "ibbb", "" };
+    loop loop;
+    executor pool{ 1 };
+    auto started = std::make_shared<std::atomic<bool>>(false);
+    auto release = std::make_shared<std::atomic<bool>>(false);
+    auto ran = std::make_shared<std::string>();
+    queue_work(pool, ${
+        *started = true;
+        while (!*release) {
+            std::this_thread::yield();
+        }
+    });
+    while (!*started) {
+        std::this_thread::yield();
+    }
+    for (int i = 0; i < 3; ++i) {
+        queue_work(pool, background, ${
+            *ran += 'b';
+        });
+    }
+    queue_work(pool, interactive, ${
+        *ran += 'i';
+    });
+    *release = true;
+    queue_work(pool, background, ${}) >>= ${
+        order.inform(*ran);
+        EXPECT_EQ(pool.stats(interactive).tasks, 1u);
+        EXPECT_EQ(pool.stats(background).tasks, 4u);
+    };
+}
+
+TEST(ExecutorTests, Aging)
+{
+    using namespace wave;
+    spy<bool> served{ true, false };
+    loop loop;
+    executor pool{ 1 };
+    auto release = std::make_shared<std::atomic<bool>>(false);
+    auto ran = std::make_shared<std::string>();
+    queue_work(pool, ${
+        while (!*release) {
+            std::this_thread::yield();
+        }
+    });
+    queue_work(pool, background, ${
+        *ran += 'b';
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    for (int i = 0; i < 40; ++i) {
+        queue_work(pool, interactive, ${
+            *ran += 'i';
+        });
+    }
+    *release = true;
+    queue_work(pool, background, ${}) >>= ${
+        served.inform(ran->find('b') < 40);
+    };
+}
+
+TEST(ParallelTests, Ordered)
+{
+    using namespace wave;
+    spy<std::string> out{ "0123456789", "" };
+    loop loop;
+    auto result = std::make_shared<std::string>();
+    function<int> numbers;
+    numbers >>= parallel_map(4, $(int i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds((10 - i) % 3));
+        return std::to_string(i);
+    }) >>= $(std::string s) {
+        *result += s;
+        out.inform(*result);
+    };
+    for (int i = 0; i < 10; ++i) {
+        numbers(i);
+    }
+}
+
+TEST(ParallelTests, Unordered)
+{
+    using namespace wave;
+    spy<int> sum{ 45, 0 };
+    loop loop;
+    executor pool{ 3 };
+    auto total = std::make_shared<int>(0);
+    function<int> numbers;
+    numbers >>= parallel_map_unordered(pool, 2, $(int i) {
+        return i;
+    }) >>= $(int i) {
+        *total += i;
+        sum.inform(*total);
+    };
+    for (int i = 0; i < 10; ++i) {
+        numbers(i);
+    }
+}
+
+TEST(WorkerTests, Result)
+{
+    using namespace wave;
+    spy<std::string> result{ "acasa", "" };
+    loop loop;
+    queue_work($ {
+        return std::string("acasa");
+    }) >>= $(std::string s) {
+        result.inform(s);
+    };
+}
+
+TEST(WorkerTests, Exception)
+{
+    using namespace wave;
+    spy<bool> thrown{ true, false };
+    loop loop;
+    executor pool{ 1 };
+    queue_work(pool, $ {
+        throw std::runtime_error("failed");
+        return 1;
+    }) >>= $(int) {
+        ADD_FAILURE();
+    } $finally {
+        try {
+            rethrow();
+        } catch (const std::runtime_error&) {
+            thrown.inform(true);
+        } catch (...) {
+        }
+    };
+}
+
+TEST(ParallelTests, For)
+{
+    using namespace wave;
+    spy<int> sum{ 4950, 0 };
+    loop loop;
+    auto values = std::make_shared<std::vector<std::atomic<int>>>(100);
+    parallel_for(0, 100, 7, $(int i) {
+        (*values)[i] = i;
+    }) >>= ${
+        int total = 0;
+        for (auto& v : *values) {
+            total += v;
+        }
+        sum.inform(total);
+    };
+}
+
+TEST(ParallelTests, Reduce)
+{
+    using namespace wave;
+    spy<long> sum{ 499500, 0 };
+    loop loop;
+    executor pool{ 3 };
+    parallel_reduce(pool, 0, 1000, 64, 0L, $(int i) {
+        return static_cast<long>(i);
+    }, $(long a, long b) {
+        return a + b;
+    }) >>= $(long total) {
+        sum.inform(total);
+    };
+}
+
 TEST(AsyncTests, Times)
 {
     using namespace wave;
@@ -207,6 +479,95 @@ TEST(AsyncTests, Times)
     };
 }
 
+TEST(AsyncTests, Producers)
+{
+    using namespace wave;
+    spy<long> sum{ 4 * (9999L * 10000 / 2), 0 };
+    loop loop;
+    async_function<int> s;
+    auto received = std::make_shared<long>(0);
+    auto count = std::make_shared<int>(0);
+    s >>= $(int i) {
+        *received += i;
+        if (++(*count) == 40000) {
+            sum.inform(*received);
+            s.close();
+        }
+    };
+    std::vector<std::thread> producers;
+    for (int t = 0; t < 4; ++t) {
+        producers.emplace_back([s]() {
+            for (int i = 0; i < 10000; ++i) {
+                s(i);
+            }
+        });
+    }
+    for (auto& t : producers) {
+        t.join();
+    }
+}
+
+TEST(AsyncTests, Channel)
+{
+    using namespace wave;
+    spy<long> sum{ 4 + 999L * 1000 / 2, 0 };
+    loop loop;
+    async_channel<int> c{ 3 };
+    EXPECT_EQ(c.capacity(), 4u);
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_TRUE(c.try_send(1));
+    }
+    EXPECT_FALSE(c.try_send(1));
+    EXPECT_FALSE(c.send_for(std::chrono::milliseconds(1), 1));
+    EXPECT_EQ(c.depth(), 4u);
+
+    auto received = std::make_shared<long>(0);
+    auto count = std::make_shared<int>(0);
+    auto producer = std::make_shared<std::thread>([c]() {
+        for (int i = 0; i < 1000; ++i) {
+            c.send(i);
+        }
+    });
+    c >>= $(int i) {
+        *received += i;
+        if (++(*count) == 1004) {
+            sum.inform(*received);
+            producer->join();
+            c.close();
+        }
+    };
+}
+
+TEST(AsyncTests, ChannelClose)
+{
+    using namespace wave;
+    auto sent = std::make_shared<std::atomic<long>>(0);
+    auto received = std::make_shared<long>(0);
+    std::vector<std::thread> threads;
+    {
+        loop loop;
+        async_channel<int> c{ 16 };
+        c >>= $(int) {
+            ++(*received);
+        };
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([c, sent]() {
+                for (int i = 0; i < 100000 && c.send(i); ++i) {
+                    ++(*sent);
+                }
+            });
+        }
+        threads.emplace_back([c]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            c.close();
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    EXPECT_EQ(*received, sent->load());
+}
+
 TEST(TcpTests, ServerClient)
 {
     using namespace wave;
@@ -237,3 +598,688 @@ TEST(TcpTests, ServerClient)
         };
     };
 }
+
+TEST(TcpTests, ReusePort)
+{
+    using namespace wave;
+    const unsigned loops = 4;
+    const int clients = 32;
+    auto accepted = std::make_shared<std::array<std::atomic<int>, loops>>();
+    auto total = std::make_shared<std::atomic<int>>(0);
+    auto listening = std::make_shared<std::atomic<unsigned>>(0);
+    auto servers = std::make_shared<std::vector<std::shared_ptr<tcp_server>>>(loops);
+    {
+        loop_group group{ loops };
+        group >>= $(unsigned index) {
+            auto server = std::make_shared<tcp_server>(5001, reuse_port);
+            *server >>= ${
+                server->accept().close();
+                (*accepted)[index]++;
+                (*total)++;
+            };
+            (*servers)[index] = server;
+            (*listening)++;
+        };
+        while (*listening < loops) {
+            std::this_thread::yield();
+        }
+
+        {
+            loop loop;
+            for (int i = 0; i < clients; ++i) {
+                tcp_client client{ "127.0.0.1", 5001 };
+                client.connected() >>= ${
+                    client.close();
+                };
+            }
+        }
+        while (*total < clients) {
+            std::this_thread::yield();
+        }
+        group >>= $(unsigned index) {
+            (*servers)[index]->close();
+            (*servers)[index].reset();
+        };
+    }
+    int busy = 0;
+    for (auto& n : *accepted) {
+        busy += n > 0;
+    }
+    EXPECT_GT(busy, 1);
+}
+
+TEST(TcpTests, Acceptor)
+{
+    using namespace wave;
+    auto main_id = std::this_thread::get_id();
+    auto received = std::make_shared<std::atomic<int>>(0);
+    auto threads_mutex = std::make_shared<std::mutex>();
+    auto threads = std::make_shared<std::map<std::thread::id, int>>();
+    {
+        loop_group workers{ 2 };
+        loop loop;
+        tcp_acceptor acceptor{ 5002, workers };
+        acceptor >>= $(tcp_client client) {
+            EXPECT_NE(main_id, std::this_thread::get_id());
+            {
+                std::lock_guard<std::mutex> lock(*threads_mutex);
+                ++(*threads)[std::this_thread::get_id()];
+            }
+            client >>= $(std::string data) {
+                EXPECT_EQ(data, "acasa");
+                (*received)++;
+            } $finally {
+                client.close();
+            };
+        };
+
+        // Clients stay connected until all were served, so every
+        // hand-off sees the load of the previous ones.
+        auto clients = std::make_shared<std::vector<tcp_client>>();
+        idle{ 4 } >>= ${
+            tcp_client client{ "127.0.0.1", 5002 };
+            clients->push_back(client);
+            client.connected() >>= ${
+                client << "acasa";
+            };
+        };
+        timer poll{ 1, 0 };
+        poll >>= ${
+            if (*received == 4) {
+                for (auto& c : *clients) {
+                    c.close();
+                }
+                acceptor.close();
+                poll.stop();
+            }
+        };
+    }
+    EXPECT_EQ(received->load(), 4);
+    ASSERT_EQ(threads->size(), 2u);
+    for (auto& t : *threads) {
+        EXPECT_EQ(t.second, 2);
+    }
+}
+
+TEST(TcpTests, AcceptorFailure)
+{
+    using namespace wave;
+    auto finalized = std::make_shared<std::atomic<int>>(0);
+    auto closed = std::make_shared<int>(0);
+    {
+        loop_group workers{ 2 };
+        loop loop;
+        tcp_acceptor acceptor{ 5003, workers };
+        acceptor >>= $(tcp_client) {
+            throw std::runtime_error("refused");
+        } $finally {
+            (*finalized)++;
+        };
+
+        // The failed workers close their connections.
+        idle{ 3 } >>= ${
+            tcp_client client{ "127.0.0.1", 5003 };
+            client >>= $(std::string) {
+                ADD_FAILURE();
+            } $finally {
+                client.close();
+                if (++(*closed) == 3) {
+                    acceptor.close();
+                }
+            };
+        };
+    }
+    EXPECT_EQ(*closed, 3);
+    EXPECT_EQ(finalized->load(), 1);
+}
+
+TEST(TcpTests, PipelinedWrites)
+{
+    using namespace wave;
+    spy<std::string> tcp_read{ "abc", "" };
+    spy<int> tcp_wrote{ 3, 0 };
+    loop loop;
+    tcp_server server{ 5003 };
+    server >>= ${
+        auto client = server.accept();
+        auto received = std::make_shared<std::string>();
+        client >>= $(std::string data) {
+            *received += data;
+            tcp_read.inform(*received);
+            if (received->size() == 3) {
+                server.close();
+                client.close();
+            }
+        };
+    };
+
+    idle{} >>= ${
+        tcp_client client{ "127.0.0.1", 5003 };
+        client.connected() >>= ${
+            auto wrote = std::make_shared<int>(0);
+            client.wrote() >>= ${
+                tcp_wrote.inform(++(*wrote));
+            };
+            client << "a" << std::string("b") << "c";
+        };
+    };
+}
+
+TEST(TcpTests, EchoBuffer)
+{
+    using namespace wave;
+    spy<std::string> echo{ "acasa", "" };
+    loop loop;
+    tcp_server server{ 5004 };
+    server >>= ${
+        auto client = server.accept();
+        client >>= $(buffer data) {
+            client << data;
+            server.close();
+        };
+    };
+
+    idle{} >>= ${
+        tcp_client client{ "127.0.0.1", 5004 };
+        client.connected() >>= ${
+            client >>= $(buffer data) {
+                echo.inform(data);
+                client.close();
+            };
+            client << "acasa";
+        };
+    };
+}
+
+TEST(TcpTests, SmallFirstRead)
+{
+    using namespace wave;
+    const std::string message(5000, 'x');
+    spy<size_t> received{ 5000, 0 };
+    loop loop;
+    tcp_server server{ 5005 };
+    server >>= ${
+        auto client = server.accept();
+        auto total = std::make_shared<size_t>(0);
+        client.small_first_read();
+        client >>= $(buffer data) {
+            *total += data.size();
+            if (*total == 5000) {
+                received.inform(*total);
+                client.close();
+                server.close();
+            }
+        };
+    };
+
+    idle{} >>= ${
+        tcp_client client{ "127.0.0.1", 5005 };
+        client.connected() >>= ${
+            client << message;
+            client.wrote() >>= ${
+                client.close();
+            };
+        };
+    };
+}
+
+TEST(TcpTests, TryWrite)
+{
+    using namespace wave;
+    spy<std::string> tcp_read{ "acasa", "" };
+    spy<bool> wrote_later{ true, false };
+    spy<int> wrote{ 1, 0 };
+    loop loop;
+    tcp_server server{ 5006 };
+    server >>= ${
+        auto client = server.accept();
+        client >>= $(std::string data) {
+            tcp_read.inform(data);
+            client.close();
+            server.close();
+        };
+    };
+
+    idle{} >>= ${
+        tcp_client client{ "127.0.0.1", 5006 };
+        client.connected() >>= ${
+            auto count = std::make_shared<int>(0);
+            client.wrote() >>= ${
+                wrote.inform(++(*count));
+                client.close();
+            };
+            client << "acasa";
+            wrote_later.inform(*count == 0);
+        };
+    };
+}
+
+TEST(TcpTests, Throttle)
+{
+    using namespace wave;
+    spy<std::string> forwarded{ "helloacasa", "" };
+    spy<size_t> pending{ 5, 0 };
+    loop loop;
+    tcp_server sink_server{ 5008 };
+    sink_server >>= ${
+        auto peer = sink_server.accept();
+        auto received = std::make_shared<std::string>();
+        peer >>= $(std::string data) {
+            *received += data;
+            forwarded.inform(*received);
+            if (received->size() == 10) {
+                peer.close();
+                sink_server.close();
+            }
+        };
+    };
+
+    tcp_server server{ 5007 };
+    server >>= ${
+        auto up = server.accept();
+        tcp_client sink{ "127.0.0.1", 5008 };
+        sink.connected() >>= ${};
+        auto wrote = std::make_shared<int>(0);
+        sink.wrote() >>= ${
+            if (++(*wrote) == 2) {
+                sink.close();
+            }
+        };
+        up >>= $(buffer data) {
+            sink << data;
+            up.close();
+            server.close();
+        };
+        // Nothing is read from up until the sink drains its first write.
+        sink.throttle(up, 4, 0);
+        sink << "hello";
+        pending.inform(sink.pending_bytes());
+    };
+
+    idle{} >>= ${
+        tcp_client client{ "127.0.0.1", 5007 };
+        client.connected() >>= ${
+            client.wrote() >>= ${
+                client.close();
+            };
+            client << "acasa";
+        };
+    };
+}
+
+TEST(CancelTests, Deadline)
+{
+    using namespace wave;
+    spy<bool> ticked{ false, false };
+    loop loop;
+    cancellation token;
+    token.cancel_after(10);
+    timer{ 10000 }.cancel_on(token) >>= ${
+        ticked.inform(true);
+    };
+}
+
+TEST(CancelTests, Pipeline)
+{
+    using namespace wave;
+    spy<int> received{ 1, 0 };
+    spy<bool> cancelled{ true, false };
+    cancellation token;
+    function<int> numbers;
+    numbers >>= cancellable(token, $(int i) {
+        return i;
+    }) >>= $(int i) {
+        received.inform(i);
+    } $finally {
+        try {
+            rethrow();
+        } catch (const operation_cancelled&) {
+            cancelled.inform(true);
+        } catch (...) {
+        }
+    };
+    numbers(1);
+    token.cancel();
+    numbers(2);
+    EXPECT_TRUE(token.cancelled());
+}
+
+TEST(CancelTests, Work)
+{
+    using namespace wave;
+    spy<bool> ran{ false, false };
+    spy<bool> finished{ true, false };
+    loop loop;
+    executor pool{ 1 };
+    cancellation token;
+    auto release = std::make_shared<std::atomic<bool>>(false);
+    queue_work(pool, ${
+        while (!*release) {
+            std::this_thread::yield();
+        }
+    });
+    queue_work(pool, ${
+        ran.inform(true);
+    }).cancel_on(token) >>= ${
+        ADD_FAILURE();
+    } $finally {
+        finished.inform(true);
+    };
+    token.cancel();
+    *release = true;
+}
+
+TEST(CancelTests, Stream)
+{
+    using namespace wave;
+    spy<bool> closed{ true, false };
+    loop loop;
+    cancellation token;
+    tcp_server server{ 5009 };
+    server >>= ${
+        auto peer = server.accept();
+        peer >>= $(std::string) {
+        } $finally {
+            closed.inform(true);
+            peer.close();
+            server.close();
+        };
+    };
+
+    tcp_client client{ "127.0.0.1", 5009 };
+    client.cancel_on(token);
+    client.connected() >>= ${
+        token.cancel();
+    };
+}
+
+TEST(WheelTests, Order)
+{
+    using namespace wave;
+    spy<std::string> fired{ "abc", "" };
+    loop loop;
+    auto order = std::make_shared<std::string>();
+    wheel_timer c{ 90 };
+    wheel_timer a{ 5 };
+    wheel_timer b{ 70 };
+    wheel_timer never{ 20 };
+    a >>= ${ *order += 'a'; };
+    b >>= ${ *order += 'b'; };
+    c >>= ${
+        *order += 'c';
+        fired.inform(*order);
+    };
+    never >>= ${ *order += 'x'; };
+    never.cancel();
+    b.reschedule(30);
+}
+
+TEST(WheelTests, IdleTimeout)
+{
+    using namespace wave;
+    spy<bool> closed{ true, false };
+    loop loop;
+    tcp_server server{ 5010 };
+    server >>= ${
+        auto peer = server.accept();
+        peer.idle_timeout(20);
+        peer >>= $(std::string) {
+        } $finally {
+            closed.inform(true);
+            server.close();
+        };
+    };
+
+    tcp_client client{ "127.0.0.1", 5010 };
+    client.connected() >>= ${
+        client >>= $(std::string) {
+        } $finally {
+            client.close();
+        };
+    };
+}
+
+TEST(TimerTests, Restart)
+{
+    using namespace wave;
+    spy<int> ticks{ 1, 0 };
+    spy<bool> pushed_back{ true, false };
+    loop loop;
+    auto start = std::chrono::steady_clock::now();
+    timer t{ 20 };
+    auto count = std::make_shared<int>(0);
+    t >>= ${
+        ticks.inform(++(*count));
+        pushed_back.inform(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(40));
+    };
+    // Pushed back twice before it could fire, the last time at 15 ms
+    // with the 30 ms interval set at 10 ms.
+    timer{ 10 } >>= ${
+        t.restart(30);
+    };
+    timer{ 15 } >>= ${
+        t.again();
+    };
+}
+
+TEST(TimerTests, RestartAfterExpiry)
+{
+    using namespace wave;
+    spy<int> fired{ 2, 0 };
+    loop loop;
+    auto count = std::make_shared<int>(0);
+    auto other = std::make_shared<std::unique_ptr<timer>>();
+    auto tick = ${
+        fired.inform(++(*count));
+        if (*count == 2) {
+            (*other)->stop();
+        }
+    };
+    timer t{ 5 };
+    t >>= tick;
+    timer{ 20 } >>= ${
+        // The fired timer keeps its handle, a new one gets fresh memory.
+        other->reset(new timer{ 1000 });
+        **other >>= ${
+            ADD_FAILURE();
+        };
+        t.restart(10);
+        t >>= tick;
+    };
+}
+
+TEST(TimerTests, SelfReferenceReleased)
+{
+    using namespace wave;
+    spy<size_t> open{ 1, 0 };
+    loop loop;
+    for (int i = 0; i < 1000; ++i) {
+        timer t{ 1 };
+        t >>= [t] {};
+    }
+    timer{ 20 } >>= ${
+        // Only this timer is left, the fired ones broke their cycles.
+        open.inform(detail::current_loop_handle().service<detail::timer_registry>().size());
+    };
+}
+
+TEST(TimerTests, Interval)
+{
+    using namespace wave;
+    spy<unsigned long long> interval{ 2, 0 };
+    loop loop;
+    timer t{ 1, 3 };
+    t >>= ${
+        t.set_interval(2);
+        interval.inform(t.interval());
+    };
+}
+
+TEST(TimerTests, HighResolution)
+{
+    using namespace wave;
+    spy<uint64_t> ticks{ 20, 0 };
+    spy<bool> paced{ true, false };
+    loop loop;
+    auto start = std::chrono::steady_clock::now();
+    auto total = std::make_shared<uint64_t>(0);
+    hires_timer t{ std::chrono::microseconds(100), 20 };
+    t >>= $(uint64_t expirations) {
+        *total += expirations;
+        ticks.inform(*total);
+        if (*total >= 20) {
+            paced.inform(std::chrono::steady_clock::now() - start >= std::chrono::microseconds(2000));
+        }
+    };
+}
+
+TEST(TimerTests, Deadline)
+{
+    using namespace wave;
+    spy<bool> reached{ true, false };
+    loop loop;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(1500);
+    hires_timer t{ deadline };
+    t >>= $(uint64_t) {
+        reached.inform(std::chrono::steady_clock::now() >= deadline);
+    };
+}
+
+TEST(TimerTests, Slack)
+{
+    using namespace wave;
+    spy<int> fired{ 50, 0 };
+    spy<bool> shared{ true, false };
+    loop loop;
+    auto count = std::make_shared<int>(0);
+    for (int i = 0; i < 50; ++i) {
+        timer{ static_cast<unsigned long long>(1 + i % 10), 1, 100 } >>= ${
+            fired.inform(++*count);
+        };
+    }
+    timer{ 300 } >>= ${
+        auto stats = timer_slack_stats();
+        shared.inform(stats.wakeups <= 2 && stats.wakeups + stats.saved == 50);
+    };
+}
+
+TEST(IdleTests, Budget)
+{
+    using namespace wave;
+    spy<int> chunks{ 50, 0 };
+    spy<bool> interleaved{ true, false };
+    spy<bool> once{ true, false };
+    loop loop;
+    set_idle_budget(std::chrono::microseconds(500));
+    auto done = std::make_shared<int>(0);
+    when_idle([done, chunks]() mutable {
+        auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(200);
+        while (std::chrono::steady_clock::now() < until);
+        chunks.inform(++*done);
+        return *done < 50;
+    });
+    when_idle([once]() mutable {
+        once.inform(true);
+    });
+    timer{ 2 } >>= ${
+        interleaved.inform(*done > 0 && *done < 50);
+    };
+}
+
+TEST(PostTests, Order)
+{
+    using namespace wave;
+    spy<std::string> order{ "tdpn", "" };
+    spy<int> count{ 1000, 0 };
+    loop loop;
+    auto trace = std::make_shared<std::string>();
+    timer{ 1 } >>= ${
+        defer([=]() mutable {
+            *trace += "d";
+            post_local([=]() mutable {
+                *trace += "n";
+                order.inform(*trace);
+            });
+        });
+        post_local([=] { *trace += "p"; });
+        *trace += "t";
+    };
+    auto n = std::make_shared<int>(0);
+    for (int i = 0; i < 1000; ++i) {
+        post_local([=]() mutable { count.inform(++*n); });
+    }
+}
+
+TEST(TcpTests, ErrorChannel)
+{
+    using namespace wave;
+    spy<int> error{ UV_EOF, 0 };
+    spy<bool> clean{ true, false };
+    loop loop;
+    tcp_server server{ 5011 };
+    server >>= ${
+        auto peer = server.accept();
+        peer >>= $(std::string data) {
+            return data.size();
+        } >>= $(size_t) {
+        } $error(status) {
+            error.inform(status);
+        } $finally {
+            clean.inform(!std::current_exception());
+            peer.close();
+            server.close();
+        };
+    };
+
+    tcp_client client{ "127.0.0.1", 5011 };
+    client.connected() >>= ${
+        client << "bye";
+        client.close();
+    };
+}
+
+TEST(TcpTests, AddressInUse)
+{
+    using namespace wave;
+    spy<int> server_error{ UV_EADDRINUSE, 0 };
+    spy<int> acceptor_error{ UV_EADDRINUSE, 0 };
+    loop_group workers{ 1 };
+    loop loop;
+    tcp_server first{ 5012 };
+    first >>= ${
+        ADD_FAILURE();
+    };
+
+    tcp_server second{ 5012 };
+    second >>= ${
+        ADD_FAILURE();
+    } $error(status) {
+        server_error.inform(status);
+    };
+
+    tcp_acceptor acceptor{ 5012, workers };
+    acceptor >>= $(tcp_client) {
+        ADD_FAILURE();
+    } $error(status) {
+        acceptor_error.inform(status);
+    };
+    first.close();
+}
+
+TEST(WheelTests, AfterIdle)
+{
+    using namespace wave;
+    spy<bool> fired{ true, false };
+    loop loop;
+    wheel_timer first{ 1 };
+    first >>= ${
+        timer{ 100 } >>= ${
+            auto start = std::chrono::steady_clock::now();
+            wheel_timer later{ 5 };
+            later >>= ${
+                auto elapsed = std::chrono::steady_clock::now() - start;
+                fired.inform(elapsed >= std::chrono::milliseconds(4) && elapsed < std::chrono::milliseconds(50));
+            };
+        };
+    };
+}